@@ -8,16 +8,26 @@
 //              Written by Ian Forster-Lewis www.forsterlewis.com
 //------------------------------------------------------------------------------
 
+#include <winsock2.h> // before windows.h
 #include <windows.h>
+#include <afunix.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <strsafe.h>
 #include <math.h>
 #include <time.h>
 #include <io.h>
+#include <share.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
 
 #include "SimConnect.h"
 
+#pragma comment(lib, "ws2_32.lib")
+
 // b21_logger version 
 double version = 1.18;
 
@@ -29,6 +39,8 @@ bool debug_events = false; // greater level of debug - events
 
 bool menu_show_text = false; // boolean to decide whether to display debug text in FSX window
 
+int worker_threads = 0; // threads for parallel work, 0 = one per cpu ('threads=N' on command line)
+
 const int MAXBUF = 1000; // max length of an IGC file line or a filename
 const int MAXC = 20; // max number of C records collectable from PLN file
 
@@ -113,6 +125,7 @@ static enum DATA_REQUEST_ID {
     REQUEST_USER_POS,
 	REQUEST_STARTUP_DATA,
 	REQUEST_AIRCRAFT_DATA,
+	REQUEST_COUNT
 };
 
 // GROUP_ID and INPUT_ID are used for keystroke events in testing
@@ -132,6 +145,8 @@ static enum DEFINITION_ID {
 	DEFINITION_AIRCRAFT,
 };
 
+// the fix channels at the start of a DEFINITION_USER_POS sample (see igc_channels),
+// which SimConnect packs without padding, at the same offsets as here
 struct UserStruct {
     double latitude;
     double longitude;
@@ -153,6 +168,104 @@ struct AircraftStruct { // variable length strings ATC ID, ATC TYPE, TITLE
 	char strings[1];
 };
 
+//*******************************************************************************
+//**************** DATA CHANNELS ************************************************
+//
+// DEFINITION_USER_POS is built from igc_channels: the fix channels UserStruct
+// names, then those added to each B record and declared in the I record, then
+// those in the K records declared in the J record. A sample is decoded where
+// SimConnect puts it, each channel at its offset, so logging another variable
+// is a line in the table.
+
+struct IgcChannel {
+	char *name;               // simulation variable
+	char *units;
+	SIMCONNECT_DATATYPE type; // SIMCONNECT_DATATYPE_FLOAT64 or SIMCONNECT_DATATYPE_INT32
+	char *code;               // three letter code in the I or J record
+	int width;                // chars in the B or K record, the first a '-' when negative
+	double scale;             // from units to the number recorded
+	int offset;               // in a sample, set by igc_channels_init()
+	int min;                  // recorded range for the width, set by igc_channels_init()
+	int max;
+};
+
+const int IGC_FIX_CHANNELS = 6;
+const int IGC_B_CHANNELS = 2;
+const int IGC_K_CHANNELS = 3;
+const int IGC_EXT_CHANNELS = IGC_B_CHANNELS + IGC_K_CHANNELS;
+const int IGC_CHANNELS = IGC_FIX_CHANNELS + IGC_EXT_CHANNELS;
+
+IgcChannel igc_channels[IGC_CHANNELS] = {
+	// fixes, as in UserStruct
+	{"Plane Latitude",         "degrees",             SIMCONNECT_DATATYPE_FLOAT64},
+	{"Plane Longitude",        "degrees",             SIMCONNECT_DATATYPE_FLOAT64},
+	{"PLANE ALTITUDE",         "meters",              SIMCONNECT_DATATYPE_FLOAT64},
+	{"SIM ON GROUND",          "bool",                SIMCONNECT_DATATYPE_INT32},
+	{"ZULU TIME",              "seconds",             SIMCONNECT_DATATYPE_INT32},
+	{"GENERAL ENG RPM:1",      "Rpm",                 SIMCONNECT_DATATYPE_INT32},
+	// B records, after FXA and ENL
+	{"AIRSPEED INDICATED",     "kilometers per hour", SIMCONNECT_DATATYPE_FLOAT64, "IAS", 3, 1.0},
+	{"VERTICAL SPEED",         "meters per second",   SIMCONNECT_DATATYPE_FLOAT64, "VAR", 3, 10.0}, // tenths
+	// K records
+	{"AMBIENT WIND DIRECTION", "degrees",             SIMCONNECT_DATATYPE_FLOAT64, "WDI", 3, 1.0},
+	{"AMBIENT WIND VELOCITY",  "kilometers per hour", SIMCONNECT_DATATYPE_FLOAT64, "WSP", 3, 1.0},
+	{"FLAPS HANDLE INDEX",     "number",              SIMCONNECT_DATATYPE_FLOAT64, "FLP", 2, 1.0},
+};
+
+const int IGC_SAMPLE_MAX = IGC_CHANNELS * 8; // bytes, if every channel was a FLOAT64
+int igc_sample_size = 0; // bytes, set by igc_channels_init()
+
+// a sample as it comes in pObjData->dwData
+union IgcSample {
+	UserStruct pos;
+	char data[IGC_SAMPLE_MAX];
+};
+
+// bytes of channel k in a sample
+inline int igc_channel_size(int k) {
+	return (igc_channels[k].type==SIMCONNECT_DATATYPE_INT32) ? 4 : 8;
+}
+
+void igc_channels_init() {
+	int offset = 0;
+
+	for (int k=0; k<IGC_CHANNELS; k++) {
+		IgcChannel *ch = &igc_channels[k];
+		ch->offset = offset;
+		offset += igc_channel_size(k);
+		ch->max = 1;
+		for (int i=0; i<ch->width; i++) ch->max *= 10;
+		ch->min = -(ch->max/10 - 1);
+		ch->max--;
+	}
+	igc_sample_size = offset;
+}
+
+// channel k of s as it is recorded, scaled, rounded and held to its width
+INT16 igc_channel_int(const IgcSample *s, int k) {
+	const IgcChannel *ch = &igc_channels[k];
+	double v;
+
+	if (ch->type==SIMCONNECT_DATATYPE_INT32) {
+		INT32 i;
+		memcpy(&i, s->data+ch->offset, sizeof(i));
+		v = i;
+	} else memcpy(&v, s->data+ch->offset, sizeof(v));
+	v = nearbyint(v * ch->scale);
+	if (v!=v) return 0;
+	return (INT16)((v>ch->max) ? ch->max : (v<ch->min) ? ch->min : v);
+}
+
+// set channel k of s to v, in its units
+void igc_channel_set(IgcSample *s, int k, double v) {
+	const IgcChannel *ch = &igc_channels[k];
+
+	if (ch->type==SIMCONNECT_DATATYPE_INT32) {
+		INT32 i = (INT32)v;
+		memcpy(s->data+ch->offset, &i, sizeof(i));
+	} else memcpy(s->data+ch->offset, &v, sizeof(v));
+}
+
 //*******************************************************************************
 
 // create var to hold user plane position
@@ -173,6 +286,7 @@ static enum CHKSUM_RESULT {
 	CHKSUM_BAD,
 	CHKSUM_FILE_ERROR,
 };
+char *chksum_result_names[] = { "CHKSUM_OK", "CHKSUM_NOT_FOUND", "CHKSUM_TOO_SHORT", "CHKSUM_BAD", "CHKSUM_FILE_ERROR" };
 
 // number of characters to include in checksum
 const int CHK_CHARS = 63; // number of chars in chk_source and chk_map
@@ -195,39 +309,147 @@ struct ChksumData {
 	int num[CHKSUM_CHARS];
 };
 
-// incrementally update checksum given current char c
-void incr_chksum(ChksumData *chk_data, char c) {
-	unsigned int c_pos = 0;
-	// convert c to int via chk_source array
-	while (c_pos<CHK_CHARS && chk_source[c_pos]!=c) c_pos++;
-	// if c not found then simply return (only need checksum valid chars)
-	if (c_pos==CHK_CHARS) return;
-
-	// now c_pos is index of c in char_source, get mapped number
-	int map_num = chk_map[(c_pos + chk_data->index) % CHK_CHARS];
+// lookup tables built once by chksum_init_tables() so the per-byte update
+// needs no search of chk_source and no '%' operations
+const unsigned char CHK_INVALID = 0xFF; // chk_pos[] value for chars not in chk_source
+// chk_pos[c] = position of byte c in chk_source, or CHK_INVALID
+unsigned char chk_pos[256];
+// chk_fold[n] = chk_map[n % CHK_CHARS] for n = c_pos + (index % CHK_CHARS)
+unsigned char chk_fold[2*CHK_CHARS];
+// chk_lane[i][n] = chk_map[(n+i) % CHK_CHARS] for n = num[i] + map_num
+unsigned char chk_lane[CHKSUM_CHARS][2*CHK_CHARS];
+
+// SIMD pre-pass used by chksum_bytes() to skip chars not in chk_source
+static enum CHKSUM_SIMD {
+	CHKSUM_SIMD_SCALAR,
+	CHKSUM_SIMD_SSE2,
+	CHKSUM_SIMD_AVX2,
+};
+
+// set by chksum_init_tables() from the cpu features, 'nosimd' on command line forces scalar
+CHKSUM_SIMD chksum_simd = CHKSUM_SIMD_SCALAR;
+
+char *chksum_simd_names[] = { "scalar", "SSE2", "AVX2" };
+
+bool cpu_has_sse2() {
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1<<26))!=0;
+}
+
+// AVX2 needs both the cpu flag and the OS saving the YMM registers
+bool cpu_has_avx2() {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0]<7) return false;
+	__cpuid(info, 1);
+	if ((info[2] & (1<<27))==0 || (info[2] & (1<<28))==0) return false; // OSXSAVE, AVX
+	if ((_xgetbv(0) & 6)!=6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1<<5))!=0;
+}
+
+void chksum_init_tables() {
+	for (int c=0; c<256; c++) chk_pos[c] = CHK_INVALID;
+	for (int p=0; p<CHK_CHARS; p++) chk_pos[(unsigned char)chk_source[p]] = (unsigned char)p;
+	for (int n=0; n<2*CHK_CHARS; n++) {
+		chk_fold[n] = (unsigned char)chk_map[n % CHK_CHARS];
+		for (int i=0; i<CHKSUM_CHARS; i++)
+			chk_lane[i][n] = (unsigned char)chk_map[(n+i) % CHK_CHARS];
+	}
+	if (cpu_has_avx2()) chksum_simd = CHKSUM_SIMD_AVX2;
+	else if (cpu_has_sse2()) chksum_simd = CHKSUM_SIMD_SSE2;
+	else chksum_simd = CHKSUM_SIMD_SCALAR;
+}
+
+// apply one valid char (position c_pos in chk_source) to the checksum
+// index63 is kept equal to chk_data->index % CHK_CHARS by the caller
+inline void chksum_pos(ChksumData *chk_data, int *index63, int c_pos) {
+	int map_num = chk_fold[c_pos + *index63];
 	for (int i=0; i<CHKSUM_CHARS; i++) {
-		chk_data->num[i] = chk_map[(chk_data->num[i]+map_num+i) % CHK_CHARS];
+		chk_data->num[i] = chk_lane[i][chk_data->num[i] + map_num];
 	}
 	// Increment checksum_index
-	chk_data->index = (chk_data->index + 1) % CHKSUM_MAX_INDEX;
+	if (++chk_data->index==CHKSUM_MAX_INDEX) {
+		chk_data->index = 0;
+		*index63 = 0;
+	} else if (++*index63==CHK_CHARS) *index63 = 0;
+}
+
+// chk_source is exactly '0'-'9', 'A'-'Z', 'a'-'z' and '.'
+// (x | 0x20) folds 'A'-'Z' onto 'a'-'z' and nothing else onto that range
+inline unsigned int chksum_mask_sse2(const char *s) {
+	__m128i x = _mm_loadu_si128((const __m128i *)s);
+	__m128i lx = _mm_or_si128(x, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0'-1)), 
+								  _mm_cmplt_epi8(x, _mm_set1_epi8('9'+1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lx, _mm_set1_epi8('a'-1)), 
+								  _mm_cmplt_epi8(lx, _mm_set1_epi8('z'+1)));
+	__m128i dot = _mm_cmpeq_epi8(x, _mm_set1_epi8('.'));
+	return (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha), dot));
+}
+
+inline unsigned int chksum_mask_avx2(const char *s) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)s);
+	__m256i lx = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+	__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0'-1)), 
+									 _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), x));
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lx, _mm256_set1_epi8('a'-1)), 
+									 _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), lx));
+	__m256i dot = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('.'));
+	return (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, alpha), dot));
+}
+
+// feed only the valid chars flagged in 'mask' (bit n = s[n]) to the checksum
+inline void chksum_mask_chars(ChksumData *chk_data, int *index63, const char *s, unsigned int mask) {
+	unsigned long n;
+	while (_BitScanForward(&n, mask)) {
+		chksum_pos(chk_data, index63, chk_pos[(unsigned char)s[n]]);
+		mask &= mask - 1;
+	}
+}
+
+// update checksum over 'len' bytes at s (chars not in chk_source are ignored)
+void chksum_bytes(ChksumData *chk_data, const char *s, size_t len) {
+	ChksumData d = *chk_data; // local copy so the lanes stay in registers
+	int index63 = d.index % CHK_CHARS;
+	size_t k = 0;
+
+	// whole blocks: find the valid chars with SIMD compares, blocks of
+	// spaces, newlines or binary noise cost one compare and no lookups
+	if (chksum_simd==CHKSUM_SIMD_AVX2) {
+		for (; k+32<=len; k+=32) chksum_mask_chars(&d, &index63, s+k, chksum_mask_avx2(s+k));
+	} else if (chksum_simd==CHKSUM_SIMD_SSE2) {
+		for (; k+16<=len; k+=16) chksum_mask_chars(&d, &index63, s+k, chksum_mask_sse2(s+k));
+	}
+	// remaining bytes (or all of them with no SIMD)
+	for (; k<len; k++) {
+		int c_pos = chk_pos[(unsigned char)s[k]];
+		if (c_pos!=CHK_INVALID) chksum_pos(&d, &index63, c_pos);
+	}
+	*chk_data = d;
+}
+
+// incrementally update checksum given current char c
+void incr_chksum(ChksumData *chk_data, char c) {
+	chksum_bytes(chk_data, &c, 1);
 }
 
 // update chksum_num based on input string s
-void chksum_string(ChksumData *chk_data, char *s) {
-	for (unsigned int i=0; i<strlen(s); i++) 
-		incr_chksum(chk_data, s[i]);
+void chksum_string(ChksumData *chk_data, const char *s) {
+	chksum_bytes(chk_data, s, strlen(s));
 }
 
 // update chksum_num based on BINARY input string s
-void chksum_binary(ChksumData *chk_data, char *s, int count) {
-	for (int i=0; i<count; i++) 
-		incr_chksum(chk_data, s[i]);
+void chksum_binary(ChksumData *chk_data, const char *s, int count) {
+	chksum_bytes(chk_data, s, count);
 }
 
 // convert chk_data.num[] into string chksum
 void chksum_to_string(char chksum[CHKSUM_CHARS+1], ChksumData chk_data) {
 	for (int i=0; i<CHKSUM_CHARS;i++) 
 		chksum[i] = chk_source[chk_data.num[i] % 36];
+	chksum[CHKSUM_CHARS] = '\0'; // callers may pass an uninitialised buffer
 }
 
 void chksum_reset(ChksumData *chk_data) {
@@ -235,24 +457,302 @@ void chksum_reset(ChksumData *chk_data) {
 	for (int i=0; i<CHKSUM_CHARS;i++) chk_data->num[i]=i;
 }
 
+//*******************************************************************************
+//**************** PARALLEL CHECKSUM OF LARGE FILES *****************************
+//
+// For a given index each valid char maps every lane value num[i] to
+// chk_map[(num[i]+map_num+i) % CHK_CHARS], which is a permutation of 0..62.
+// So a chunk of input can be reduced to six composed permutations, if we
+// know the index at its start, i.e. the count of valid chars before it.
+// The file is split into chunks, every chunk is counted in parallel, then
+// every chunk is reduced in parallel and the results composed in order.
+//
+// Building the permutations costs 63 lookups per lane per char instead of
+// one, so the first chunk (whose start state is known) runs the normal
+// kernel and is given a correspondingly larger share of the input.
+
+// files smaller than this are checksummed on the calling thread
+const size_t CHKSUM_PARALLEL_MIN = 8*1024*1024;
+
+// read-only view of a whole file
+struct MappedFile {
+	HANDLE file;
+	HANDLE mapping;
+	const char *data;
+	size_t size;
+};
+
+// map the whole of filepath, returns false if it can't (including empty files)
+bool map_file(MappedFile *mf, const char *filepath) {
+	LARGE_INTEGER size;
+
+	mf->mapping = NULL;
+	mf->data = NULL;
+	mf->size = 0;
+	mf->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+						   OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (mf->file==INVALID_HANDLE_VALUE) return false;
+	if (GetFileSizeEx(mf->file, &size) && size.QuadPart>0 && (ULONGLONG)size.QuadPart<=(SIZE_T)-1) {
+		mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mf->mapping!=NULL) {
+			mf->data = (const char *)MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+			mf->size = (size_t)size.QuadPart;
+		}
+	}
+	if (mf->data==NULL) {
+		if (mf->mapping!=NULL) CloseHandle(mf->mapping);
+		CloseHandle(mf->file);
+		return false;
+	}
+	return true;
+}
+
+void unmap_file(MappedFile *mf) {
+	UnmapViewOfFile(mf->data);
+	CloseHandle(mf->mapping);
+	CloseHandle(mf->file);
+}
+
+// number of threads to use for parallel work
+int worker_count() {
+	int n = worker_threads;
+	if (n<=0) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		n = si.dwNumberOfProcessors;
+	}
+	if (n<1) n = 1;
+	if (n>MAXIMUM_WAIT_OBJECTS) n = MAXIMUM_WAIT_OBJECTS;
+	return n;
+}
+
+// call func for each of the 'count' params (param_size bytes apart), the first
+// on this thread and the rest on their own threads, and wait for all of them
+void run_threads(LPTHREAD_START_ROUTINE func, void *params, size_t param_size, int count) {
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	int n = 0;
+
+	for (int k=1; k<count; k++) {
+		LPVOID param = (char *)params + k*param_size;
+		HANDLE h = (n<MAXIMUM_WAIT_OBJECTS) ? CreateThread(NULL, 0, func, param, 0, NULL) : NULL;
+		if (h==NULL) func(param); // no thread, just do it here
+		else threads[n++] = h;
+	}
+	if (count>0) func(params);
+	if (n>0) WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+	for (int k=0; k<n; k++) CloseHandle(threads[k]);
+}
+
+inline int bit_count(unsigned int x) {
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (int)((((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+// count the chars in s that are in chk_source
+size_t chksum_count(const char *s, size_t len) {
+	size_t count = 0;
+	size_t k = 0;
+
+	if (chksum_simd==CHKSUM_SIMD_AVX2) {
+		for (; k+32<=len; k+=32) count += bit_count(chksum_mask_avx2(s+k));
+	} else if (chksum_simd==CHKSUM_SIMD_SSE2) {
+		for (; k+16<=len; k+=16) count += bit_count(chksum_mask_sse2(s+k));
+	}
+	for (; k<len; k++)
+		if (chk_pos[(unsigned char)s[k]]!=CHK_INVALID) count++;
+	return count;
+}
+
+// perm[i][v] for v in 0..62 is lane i's permutation, perm[i][63] is padding
+// so each lane is exactly two AVX2 registers
+typedef unsigned char ChksumPerm[CHKSUM_CHARS][64];
+
+// apply one char with mapped number map_num to all 63 entries of every lane
+void chksum_perm_step(ChksumPerm perm, int map_num) {
+	for (int i=0; i<CHKSUM_CHARS; i++) {
+		unsigned char *lane = chk_lane[i] + map_num;
+		for (int v=0; v<CHK_CHARS; v++) perm[i][v] = lane[perm[i][v]];
+	}
+}
+
+// the same with AVX2: the lane update is chk_map[(v + map_num + i) % CHK_CHARS],
+// i.e. an add, a conditional subtract of 63, and a lookup in the 64 byte
+// chk_map done as four in-register 16 byte shuffles
+inline __m256i chksum_perm_lookup_avx2(__m256i q, const __m256i tbl[4]) {
+	__m256i sel4 = _mm256_slli_epi16(q, 3); // bit 4 of each byte into its top bit
+	__m256i sel5 = _mm256_slli_epi16(q, 2); // bit 5 of each byte into its top bit
+	__m256i lo = _mm256_blendv_epi8(_mm256_shuffle_epi8(tbl[0], q), _mm256_shuffle_epi8(tbl[1], q), sel4);
+	__m256i hi = _mm256_blendv_epi8(_mm256_shuffle_epi8(tbl[2], q), _mm256_shuffle_epi8(tbl[3], q), sel4);
+	return _mm256_blendv_epi8(lo, hi, sel5);
+}
+
+void chksum_perm_chunk_avx2(ChksumPerm perm, int *index, const char *s, size_t len) {
+	unsigned char map_bytes[64];
+	__m256i tbl[4];
+	__m256i p[2*CHKSUM_CHARS];
+	__m256i c63 = _mm256_set1_epi8(CHK_CHARS);
+	int index63 = *index % CHK_CHARS;
+
+	for (int v=0; v<64; v++) map_bytes[v] = (unsigned char)(v<CHK_CHARS ? chk_map[v] : 0);
+	for (int t=0; t<4; t++) 
+		tbl[t] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(map_bytes + 16*t)));
+	for (int i=0; i<2*CHKSUM_CHARS; i++) p[i] = _mm256_loadu_si256((const __m256i *)(&perm[0][0] + 32*i));
+
+	for (size_t k=0; k<len; k+=32) {
+		unsigned int mask;
+		if (k+32<=len) mask = chksum_mask_avx2(s+k);
+		else {
+			mask = 0;
+			for (size_t j=k; j<len; j++) 
+				if (chk_pos[(unsigned char)s[j]]!=CHK_INVALID) mask |= 1u << (j-k);
+		}
+		unsigned long n;
+		while (_BitScanForward(&n, mask)) {
+			int map_num = chk_fold[chk_pos[(unsigned char)s[k+n]] + index63];
+			for (int i=0; i<CHKSUM_CHARS; i++) {
+				int add = map_num + i;
+				if (add>=CHK_CHARS) add -= CHK_CHARS;
+				__m256i a = _mm256_set1_epi8((char)add);
+				for (int h=0; h<2; h++) {
+					__m256i q = _mm256_add_epi8(p[2*i+h], a);
+					q = _mm256_min_epu8(q, _mm256_sub_epi8(q, c63)); // (v+add) % 63
+					p[2*i+h] = chksum_perm_lookup_avx2(q, tbl);
+				}
+			}
+			if (++*index==CHKSUM_MAX_INDEX) {
+				*index = 0;
+				index63 = 0;
+			} else if (++index63==CHK_CHARS) index63 = 0;
+			mask &= mask - 1;
+		}
+	}
+	for (int i=0; i<2*CHKSUM_CHARS; i++) _mm256_storeu_si256((__m256i *)(&perm[0][0] + 32*i), p[i]);
+}
+
+// reduce len bytes at s to lane permutations, *index is the checksum index
+// at the start of s and is updated to the index at the end
+void chksum_perm_chunk(ChksumPerm perm, int *index, const char *s, size_t len) {
+	for (int i=0; i<CHKSUM_CHARS; i++) {
+		for (int v=0; v<CHK_CHARS; v++) perm[i][v] = (unsigned char)v;
+		perm[i][CHK_CHARS] = 0;
+	}
+	if (chksum_simd==CHKSUM_SIMD_AVX2) {
+		chksum_perm_chunk_avx2(perm, index, s, len);
+		return;
+	}
+	int index63 = *index % CHK_CHARS;
+	for (size_t k=0; k<len; k++) {
+		int c_pos = chk_pos[(unsigned char)s[k]];
+		if (c_pos==CHK_INVALID) continue;
+		chksum_perm_step(perm, chk_fold[c_pos + index63]);
+		if (++*index==CHKSUM_MAX_INDEX) {
+			*index = 0;
+			index63 = 0;
+		} else if (++index63==CHK_CHARS) index63 = 0;
+	}
+}
+
+// one slice of a parallel checksum
+struct ChksumChunk {
+	const char *s;
+	size_t len;
+	size_t count;		// number of valid chars in this chunk
+	bool first;			// first chunk runs the normal kernel from the real start state
+	ChksumData chk;		// start state (or start index) in, end state (or end index) out
+	ChksumPerm perm;	// lane permutations for chunks after the first
+};
+
+DWORD WINAPI chksum_count_thread(LPVOID param) {
+	ChksumChunk *chunk = (ChksumChunk *)param;
+	chunk->count = chksum_count(chunk->s, chunk->len);
+	return 0;
+}
+
+DWORD WINAPI chksum_chunk_thread(LPVOID param) {
+	ChksumChunk *chunk = (ChksumChunk *)param;
+	if (chunk->first) chksum_bytes(&chunk->chk, chunk->s, chunk->len);
+	else chksum_perm_chunk(chunk->perm, &chunk->chk.index, chunk->s, chunk->len);
+	return 0;
+}
+
+// same result as chksum_bytes(), but large inputs are split across worker threads
+void chksum_bytes_parallel(ChksumData *chk_data, const char *s, size_t len) {
+	int threads = worker_count();
+	if (threads<2 || len<CHKSUM_PARALLEL_MIN) {
+		chksum_bytes(chk_data, s, len);
+		return;
+	}
+	ChksumChunk *chunks = (ChksumChunk *)malloc(threads * sizeof(ChksumChunk));
+	if (chunks==NULL) {
+		chksum_bytes(chk_data, s, len);
+		return;
+	}
+	// measured cost per char of building permutations relative to the normal kernel
+	size_t perm_cost = (chksum_simd==CHKSUM_SIMD_AVX2) ? 6 : 24;
+	size_t share = len / (perm_cost + threads - 1);
+	size_t pos = 0;
+	for (int k=0; k<threads; k++) {
+		chunks[k].s = s + pos;
+		chunks[k].first = (k==0);
+		if (k==threads-1) chunks[k].len = len - pos;
+		else chunks[k].len = (k==0) ? share*perm_cost : share;
+		pos += chunks[k].len;
+	}
+
+	// pass 1: count valid chars in each chunk to get each chunk's start index
+	run_threads(chksum_count_thread, chunks, sizeof(ChksumChunk), threads);
+	chunks[0].chk = *chk_data;
+	int index = chk_data->index;
+	for (int k=1; k<threads; k++) {
+		index = (int)((index + chunks[k-1].count) % CHKSUM_MAX_INDEX);
+		chunks[k].chk.index = index;
+	}
+
+	// pass 2: checksum the first chunk and reduce the others to permutations
+	run_threads(chksum_chunk_thread, chunks, sizeof(ChksumChunk), threads);
+	*chk_data = chunks[0].chk;
+	for (int k=1; k<threads; k++) {
+		for (int i=0; i<CHKSUM_CHARS; i++) chk_data->num[i] = chunks[k].perm[i][chk_data->num[i]];
+		chk_data->index = chunks[k].chk.index;
+	}
+	free(chunks);
+}
+
 CHKSUM_RESULT chksum_binary_file(char chksum[CHKSUM_CHARS+1], char *filepath) {
 	FILE *f;
 	errno_t err;
-	char buf[MAXBUF];
-	int read_count; // number of chars read
+	static const size_t CHKSUM_BUF_SIZE = 65536; // read size for binary files
+	char *buf;
+	size_t read_count; // number of chars read
+	MappedFile mf;
 	// calculated checksum as sequence of ints 0..CHK_CHARS
 	ChksumData chk_data;
 	
 	chksum_reset(&chk_data);
 
+	// checksum straight from a mapped view if we can, in parallel if it's large
+	if (map_file(&mf, filepath)) {
+		chksum_bytes_parallel(&chk_data, mf.data, mf.size);
+		unmap_file(&mf);
+		chksum_to_string(chksum, chk_data);
+		return CHKSUM_OK;
+	}
+
 	if( (err = fopen_s(&f, filepath, "rb")) != 0 ) {
         strcpy_s(chksum, CHKSUM_CHARS+1, "000000");
 		return CHKSUM_FILE_ERROR;
 	}
-	while (!feof(f)) {
-		read_count = fread(buf, sizeof(char),sizeof(buf),f);
-		chksum_binary(&chk_data, buf, read_count);
+	buf = (char *)malloc(CHKSUM_BUF_SIZE);
+	if (buf==NULL) {
+		fclose(f);
+        strcpy_s(chksum, CHKSUM_CHARS+1, "000000");
+		return CHKSUM_FILE_ERROR;
+	}
+	while ((read_count = fread(buf, sizeof(char), CHKSUM_BUF_SIZE, f)) > 0) {
+		chksum_bytes(&chk_data, buf, read_count);
 	}
+	free(buf);
 	chksum_to_string(chksum, chk_data);
 	fclose(f);
 	return CHKSUM_OK;
@@ -351,126 +851,1300 @@ CHKSUM_RESULT chksum_cfg_file(char chksum[CHKSUM_CHARS+1], char *filepath) {
 	return CHKSUM_OK;
 }
 
-// This routine is used to *check* the checksum at the end of an IGC file
-// the checksum will be stored in the final 'G' record.
-// Only alphanumeric characters before the 'G' record contribute to the checksum.
-CHKSUM_RESULT chksum_igc_file(char chksum[CHKSUM_CHARS+1], char *filepath) {
-	FILE *f;
-	errno_t err;
-	char line_buf[MAXBUF];
-	// calculated checksum as sequence of ints 0..CHK_CHARS
-	ChksumData chk_data;
-	
-	chksum_reset(&chk_data);
+// copy the checksum following the label_len char label of an L record such as
+// "L FSX GENERAL CHECKSUM            xxxxxx  <----"
+void igc_l_chksum(char chksum[CHKSUM_CHARS+1], const char *line, size_t len, size_t label_len) {
+	size_t k = label_len;
+	int n = 0;
 
-	if( (err = fopen_s(&f, filepath, "r")) != 0 ) {
-		return CHKSUM_FILE_ERROR;
-	}
-	while (fgets(line_buf, MAXBUF, f)!=NULL) {
-		if (line_buf[0]=='G') break;
-		if (strncmp(line_buf,"L FSX GENERAL", 13)==0) printf("%s",line_buf+6);
-		chksum_string(&chk_data, line_buf);
-	}
-	if (line_buf[0]!='G') {
-			return CHKSUM_NOT_FOUND;
-	}
+	while (k<len && line[k]==' ') k++;
+	while (k<len && n<CHKSUM_CHARS && line[k]!=' ' && line[k]!='\r' && line[k]!='\n') chksum[n++] = line[k++];
+	chksum[n] = '\0';
+}
 
-	if (strlen(line_buf)<CHKSUM_CHARS+1) {
+// strlen("L FSX GENERAL CHECKSUM")
+const size_t IGC_GENERAL_LABEL = 22;
+
+// compare the G record at g (data ends at end) with the checksum in chk_data
+CHKSUM_RESULT chksum_igc_g(char chksum[CHKSUM_CHARS+1], ChksumData chk_data, const char *g, const char *end) {
+	// G record length as fgets() in text mode would see it ("\r\n" -> "\n")
+	const char *line_end = (const char *)memchr(g, '\n', end-g);
+	size_t g_len = (line_end==NULL) ? end-g : line_end-g+1;
+	if (line_end!=NULL && line_end>g && line_end[-1]=='\r') g_len--;
+	if (g_len<CHKSUM_CHARS+1) {
 			return CHKSUM_TOO_SHORT;
 	}
 	chksum_to_string(chksum, chk_data);
 	for (int i=0; i<CHKSUM_CHARS; i++) {
-		if (chksum[i]!=line_buf[i+1]) {
+		if (chksum[i]!=g[i+1]) {
 			return CHKSUM_BAD;
 		}
 	}
-	fclose(f);
 	return CHKSUM_OK;
 }
 
+// check the checksum of an IGC file held in memory (see chksum_igc_file())
+CHKSUM_RESULT chksum_igc_data(char chksum[CHKSUM_CHARS+1], const char *data, size_t size, char *general) {
+	const char *end = data + size;
+	const char *line = data;
+	const char *line_end;
+	ChksumData chk_data;
+
+	chksum_reset(&chk_data);
+	if (general!=NULL) general[0] = '\0';
+
+	// find the 'G' record, everything before it is checksummed. 'G' is rare in
+	// the other records, so jump from G to G rather than from line to line
+	while ((line = (const char *)memchr(line, 'G', end-line))!=NULL) {
+		if (line==data || line[-1]=='\n') break;
+		const char *l = line-6;
+		if (l>=data && (l==data || l[-1]=='\n') && end-l>=13 && strncmp(l,"L FSX GENERAL", 13)==0) {
+			line_end = (const char *)memchr(l, '\n', end-l);
+			line_end = (line_end==NULL) ? end : line_end+1;
+			if (general!=NULL) igc_l_chksum(general, l, line_end-l, IGC_GENERAL_LABEL);
+			else printf("%.*s",(int)(line_end-line),line);
+		}
+		line++;
+	}
+	if (line==NULL) {
+			return CHKSUM_NOT_FOUND;
+	}
+	chksum_bytes_parallel(&chk_data, data, line-data);
+	return chksum_igc_g(chksum, chk_data, line, end);
+}
+
+// This routine is used to *check* the checksum at the end of an IGC file
+// the checksum will be stored in the final 'G' record.
+// Only alphanumeric characters before the 'G' record contribute to the checksum.
+// The "L FSX GENERAL CHECKSUM" line is printed, or copied into 'general' if
+// that isn't NULL (left empty if the file has no such line).
+CHKSUM_RESULT chksum_igc_file(char chksum[CHKSUM_CHARS+1], char *filepath, char *general) {
+	CHKSUM_RESULT result;
+	MappedFile mf;
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+
+	// the file is checked in place, without copying lines out of it
+	if (!map_file(&mf, filepath)) {
+		if (general!=NULL) general[0] = '\0';
+		// an empty file can't be mapped, but it is readable
+		if (GetFileAttributesExA(filepath, GetFileExInfoStandard, &attr) && 
+			!(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			attr.nFileSizeHigh==0 && attr.nFileSizeLow==0) return CHKSUM_NOT_FOUND;
+		return CHKSUM_FILE_ERROR;
+	}
+	result = chksum_igc_data(chksum, mf.data, mf.size, general);
+	unmap_file(&mf);
+	return result;
+}
+
 CHKSUM_RESULT check_file(char *pfilepath) {
 	char chksum[CHKSUM_CHARS+1] = "000000";
-	return chksum_igc_file(chksum, pfilepath);
+	return chksum_igc_file(chksum, pfilepath, NULL);
 }
 
-// this routine produces a general checksum for the
-// FLT, WX, CMX, AIR, aircraft.cfg files
-// so if this is correct the user does not have to look at the 
-// individual checksums
-CHKSUM_RESULT chksum_chksum(char chksum[CHKSUM_CHARS+1]) {
-	ChksumData chk_data;
+//*******************************************************************************
+//**************** STRUCTURAL VALIDATION OF IGC FILES ***************************
+//
+// Checks a file against the layout igc_write_file() produces, in the same pass
+// as the checksum: records in A,H,I,J,C,L,B,G order with K records among the B
+// records, the one I record with FXA and ENL first, B and K records the length
+// the I and J records give, B times that don't go backwards and positions in
+// range. Errors are recorded with their line numbers.
+
+const int IGC_MAX_ERRORS = 20; // errors kept per file, any more are just counted
+const int IGC_B_LEN = 41; // length of a B record up to ENL, without its line end
+char *igc_record_order = "AHIJCLBG"; // K records rank with the B records
+char *igc_i_fixed = "3638FXA3941ENL"; // the first fields of the I record
+
+struct IgcErrors {
+	int count;
+	int line[IGC_MAX_ERRORS];
+	char *msg[IGC_MAX_ERRORS];
+};
 
-	chksum_reset(&chk_data);
+void igc_error(IgcErrors *errs, int line, char *msg) {
+	if (errs->count<IGC_MAX_ERRORS) {
+		errs->line[errs->count] = line;
+		errs->msg[errs->count] = msg;
+	}
+	errs->count++;
+}
 
-	chksum_string(&chk_data,chksum_flt);
-	chksum_string(&chk_data,chksum_air);
-	chksum_string(&chk_data,chksum_wx);
-	chksum_string(&chk_data,chksum_cmx);
-	chksum_string(&chk_data,chksum_cfg);
-	chksum_string(&chk_data,chksum_xml);
-	if (cx_code==0) 
-		chksum_string(&chk_data, "CX UNLOCKED");
-	else
-		chksum_string(&chk_data, "CX LOCKED");
+// value of the n digits at s, or -1 if they aren't all digits
+inline int igc_digits(const char *s, int n) {
+	int v = 0;
+	for (int k=0; k<n; k++) {
+		unsigned int d = (unsigned char)s[k] - '0';
+		if (d>9) return -1;
+		v = v*10 + d;
+	}
+	return v;
+}
 
-	if (wx_code==0) 
-		chksum_string(&chk_data, "WX UNLOCKED");
-	else
-		chksum_string(&chk_data, "WX LOCKED");
+// true if the n chars at s are digits or '-', as extension fields are
+inline bool igc_ext_chars(const char *s, size_t n) {
+	for (size_t k=0; k<n; k++) {
+		if ((unsigned int)((unsigned char)s[k] - '0')>9 && s[k]!='-') return false;
+	}
+	return true;
+}
 
-    if (therm_code==0)
-        chksum_string(&chk_data, "THERM FILE PRESENT");
-    else
-        chksum_string(&chk_data, "NO THERM FILE");
+// the record length an I or J record declares (len excludes the line end),
+// or -1 if its fields don't follow on from byte start
+int igc_ext_len(const char *line, size_t len, int start) {
+	int count = (len>=3) ? igc_digits(line+1, 2) : -1;
 
-	chksum_to_string(chksum, chk_data);
-	return CHKSUM_OK;
+	if (count<0 || len!=3+7*(size_t)count) return -1;
+	for (int k=0; k<count; k++) {
+		int from = igc_digits(line+3+7*k, 2), to = igc_digits(line+5+7*k, 2);
+		if (from!=start || to<from) return -1;
+		start = to+1;
+	}
+	return start-1;
 }
 
-//*******************************************************************
-//*******************************************************************
-//******************    PARSE THE PLN FILE **************************
-//*******************************************************************
+// check a B record (len excludes the line end) is b_len long, *day_time is the
+// previous fix time in seconds counting on from midnight of the first day, or -1
+void igc_check_b(IgcErrors *errs, int line_no, const char *b, size_t len, int b_len, int *day_time) {
+	if (len!=(size_t)b_len) {
+		igc_error(errs, line_no, "B record is not the length of the I record");
+		return;
+	}
+	int hh = igc_digits(b+1, 2), mm = igc_digits(b+3, 2), ss = igc_digits(b+5, 2);
+	int lat_DD = igc_digits(b+7, 2), lat_MM = igc_digits(b+9, 2), lat_mmm = igc_digits(b+11, 3);
+	int long_DDD = igc_digits(b+15, 3), long_MM = igc_digits(b+18, 2), long_mmm = igc_digits(b+20, 3);
+	// altitudes are 5 digits, or '-' and 4 digits
+	int alt_p = igc_digits(b[25]=='-' ? b+26 : b+25, b[25]=='-' ? 4 : 5);
+	int alt_g = igc_digits(b[30]=='-' ? b+31 : b+30, b[30]=='-' ? 4 : 5);
+	int fxa = igc_digits(b+35, 3), enl = igc_digits(b+38, 3);
+
+	if (hh<0 || mm<0 || ss<0 || lat_DD<0 || lat_MM<0 || lat_mmm<0 || long_DDD<0 || long_MM<0 || 
+		long_mmm<0 || alt_p<0 || alt_g<0 || fxa<0 || enl<0 || !igc_ext_chars(b+IGC_B_LEN, len-IGC_B_LEN)) {
+		igc_error(errs, line_no, "B record has a non-numeric field");
+		return;
+	}
+	if ((b[14]!='N' && b[14]!='S') || (b[23]!='E' && b[23]!='W') || (b[24]!='A' && b[24]!='V'))
+		igc_error(errs, line_no, "B record has a bad N/S, E/W or A/V flag");
+	if (lat_DD>90 || lat_MM>59 || (lat_DD==90 && (lat_MM>0 || lat_mmm>0)))
+		igc_error(errs, line_no, "B record latitude out of range");
+	if (long_DDD>180 || long_MM>59 || (long_DDD==180 && (long_MM>0 || long_mmm>0)))
+		igc_error(errs, line_no, "B record longitude out of range");
+	if (hh>23 || mm>59 || ss>59) {
+		igc_error(errs, line_no, "B record time is invalid");
+		return;
+	}
+	// a time more than 12 hours earlier than the last is taken as the next day (zulu midnight)
+	int t = hh*3600 + mm*60 + ss + (*day_time<0 ? 0 : *day_time/86400*86400);
+	if (*day_time>=0 && t<*day_time) {
+		if (*day_time-t>12*3600) t += 86400;
+		else igc_error(errs, line_no, "B record time goes backwards");
+	}
+	if (t>*day_time) *day_time = t;
+}
 
-// utility function - copy 'n' chars from src to dest
-void cpy(char *dest, int max, char *src, int n) {
-    if (n>max) return;
-    for (int i=0;i<n;i++) dest[i]=src[i];
-    return;
+// check a K record (len excludes the line end) is k_len long, -1 with no J record
+void igc_check_k(IgcErrors *errs, int line_no, const char *k, size_t len, int k_len) {
+	if (k_len<0) {
+		igc_error(errs, line_no, "K record without a J record");
+		return;
+	}
+	if (len!=(size_t)k_len) {
+		igc_error(errs, line_no, "K record is not the length of the J record");
+		return;
+	}
+	int hh = igc_digits(k+1, 2), mm = igc_digits(k+3, 2), ss = igc_digits(k+5, 2);
+	if (hh<0 || mm<0 || ss<0 || !igc_ext_chars(k+7, len-7))
+		igc_error(errs, line_no, "K record has a non-numeric field");
+	else if (hh>23 || mm>59 || ss>59)
+		igc_error(errs, line_no, "K record time is invalid");
 }
 
-// this very useful function converts in(UNICODE) to s(ascii) and strips odd chars
-void clean_string(char *s, wchar_t *in) {
-	unsigned int i = 0;
-    const wchar_t *PLN_WCHARS = L"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz.<>, ";
-	while (i<wcslen(in)) {
-        if (wcschr(PLN_WCHARS,in[i])==NULL) 
-			s[i] = ' ';
-		else
-			s[i] = char(in[i]);
-		i++;
-    }
-	s[i] = '\0';
+// validate and checksum an IGC file held in memory, one line at a time
+CHKSUM_RESULT igc_validate_data(char chksum[CHKSUM_CHARS+1], const char *data, size_t size, 
+								char *general, IgcErrors *errs) {
+	const char *end = data + size;
+	const char *line = data;
+	const char *line_end;
+	ChksumData chk_data;
+	int line_no = 0;
+	int order = 0; // position in igc_record_order of the last record
+	int a_count = 0, i_count = 0, j_count = 0, b_count = 0;
+	int b_len = IGC_B_LEN, k_len = -1; // from the I and J records
+	int day_time = -1;
+
+	chksum_reset(&chk_data);
+	if (general!=NULL) general[0] = '\0';
+	errs->count = 0;
+
+	while (line<end && line[0]!='G') {
+		line_no++;
+		line_end = (const char *)memchr(line, '\n', end-line);
+		line_end = (line_end==NULL) ? end : line_end+1;
+		chksum_bytes(&chk_data, line, line_end-line);
+		size_t len = line_end-line;
+		while (len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) len--;
+
+		const char *rank = (len>0) ? strchr(igc_record_order, line[0]=='K' ? 'B' : line[0]) : NULL;
+		if (len==0) igc_error(errs, line_no, "empty line");
+		else if (rank==NULL) igc_error(errs, line_no, "unknown record type");
+		else {
+			if (rank-igc_record_order<order) igc_error(errs, line_no, "record out of order");
+			else order = (int)(rank-igc_record_order);
+			if (line_no==1 && line[0]!='A') igc_error(errs, line_no, "first record is not an A record");
+			if (line[0]=='A' && ++a_count>1) igc_error(errs, line_no, "more than one A record");
+
+			if (line[0]=='B') {
+				b_count++;
+				igc_check_b(errs, line_no, line, len, b_len, &day_time);
+			}
+			else if (line[0]=='K') igc_check_k(errs, line_no, line, len, k_len);
+			else if (line[0]=='I') {
+				if (++i_count>1) igc_error(errs, line_no, "more than one I record");
+				int n = igc_ext_len(line, len, 36);
+				if (n<0 || igc_digits(line+1, 2)<2 || strncmp(line+3, igc_i_fixed, 14)!=0) 
+					igc_error(errs, line_no, "I record is not FXA and ENL from byte 36, then fields following on");
+				else b_len = n;
+			}
+			else if (line[0]=='J') {
+				if (++j_count>1) igc_error(errs, line_no, "more than one J record");
+				k_len = igc_ext_len(line, len, 8);
+				if (k_len<0) igc_error(errs, line_no, "J record fields don't follow on from byte 8");
+			}
+			else if (line[0]=='L' && len>=13 && general!=NULL && strncmp(line,"L FSX GENERAL", 13)==0)
+				igc_l_chksum(general, line, len, IGC_GENERAL_LABEL);
+		}
+		line = line_end;
+	}
+	if (line_no>0 && i_count==0) igc_error(errs, line_no, "no I record");
+	if (line_no>0 && b_count==0) igc_error(errs, line_no, "no B records");
+	if (line>=end) return CHKSUM_NOT_FOUND;
+
+	// nothing but line ends may follow the G record
+	line_no++;
+	for (const char *p=(const char *)memchr(line, '\n', end-line); p!=NULL && p<end; p++) {
+		if (*p=='\n') line_no++;
+		else if (*p!='\r') {
+			igc_error(errs, line_no, "data after the G record");
+			break;
+		}
+	}
+	return chksum_igc_g(chksum, chk_data, line, end);
 }
 
-CHKSUM_RESULT pln_to_c(char *filepath) {
-	FILE *f;
-	errno_t err;
+// validate and checksum an IGC file (see chksum_igc_file())
+CHKSUM_RESULT igc_validate_file(char chksum[CHKSUM_CHARS+1], char *filepath, char *general, IgcErrors *errs) {
+	CHKSUM_RESULT result;
+	MappedFile mf;
+
+	errs->count = 0;
+	if (!map_file(&mf, filepath)) {
+		if (general!=NULL) general[0] = '\0';
+		result = chksum_igc_file(chksum, filepath, general); // tells an empty file from a missing one
+		if (result==CHKSUM_NOT_FOUND) igc_error(errs, 0, "empty file");
+		return result;
+	}
+	result = igc_validate_data(chksum, mf.data, mf.size, general, errs);
+	unmap_file(&mf);
+	return result;
+}
 
-	char line_buf[MAXBUF];
-    char s[MAXBUF]; // general buffer
-	wchar_t in_buf[MAXCHAR*4]; // line input buffer
+//*******************************************************************************
+//**************** ENVIRONMENT CHECKSUMS IN IGC FILES ***************************
+//
+// The L records igc_write_file() writes for the files that set up the flight,
+// and the pilot's competition id, used to index logs by their environment.
+
+static enum IGC_ENV {
+	IGC_ENV_FLT,
+	IGC_ENV_WX,
+	IGC_ENV_CMX,
+	IGC_ENV_MISSION,
+	IGC_ENV_CFG,
+	IGC_ENV_AIR,
+	IGC_ENV_GENERAL,
+	IGC_ENV_COUNT
+};
+char *igc_env_labels[IGC_ENV_COUNT] = { "L FSX FLT checksum", "L FSX WX checksum", "L FSX CMX checksum",
+										"L FSX mission checksum", "L FSX aircraft.cfg checksum", 
+										"L FSX AIR checksum", "L FSX GENERAL CHECKSUM" };
+char *igc_env_names[IGC_ENV_COUNT] = { "flt", "wx", "cmx", "mission", "cfg", "air", "general" };
 
-    char *ptr_value; // temporary pointer into read line from PLN
-    char *ptr_end; // temp pointer to end of value
-    int value_length; // length of value up to following '<' char
+const int IGC_PILOT_CHARS = 32;
 
-    char lat_NS = ' ';
-    int lat_degs = 0;
-    int lat_mins = 0;
-    float lat_secs = 0;
-    char long_NS = ' ';
-    int long_degs = 0;
+struct IgcEnv {
+	char chksum[IGC_ENV_COUNT][CHKSUM_CHARS+1]; // empty if the file has no such line
+	char pilot[IGC_PILOT_CHARS+1]; // from HFCIDCOMPETITIONID
+};
+
+// read the environment from the records before the first B record
+void igc_env_data(IgcEnv *env, const char *data, size_t size) {
+	const char *end = data + size;
+	const char *line = data;
+	const char *line_end;
+
+	memset(env, 0, sizeof(IgcEnv));
+	while (line<end && line[0]!='B' && line[0]!='G') {
+		line_end = (const char *)memchr(line, '\n', end-line);
+		line_end = (line_end==NULL) ? end : line_end+1;
+		size_t len = line_end-line;
+		while (len>0 && (line[len-1]=='\n' || line[len-1]=='\r')) len--;
+
+		if (line[0]=='L') {
+			for (int k=0; k<IGC_ENV_COUNT; k++) {
+				size_t n = strlen(igc_env_labels[k]);
+				if (len>n && line[n]==' ' && strncmp(line, igc_env_labels[k], n)==0) {
+					igc_l_chksum(env->chksum[k], line, len, n);
+					break;
+				}
+			}
+		}
+		else if (len>19 && strncmp(line,"HFCIDCOMPETITIONID:",19)==0) {
+			size_t n = len-19;
+			if (n>IGC_PILOT_CHARS) n = IGC_PILOT_CHARS;
+			for (size_t k=0; k<n; k++) env->pilot[k] = (line[19+k]=='\t') ? ' ' : line[19+k];
+			env->pilot[n] = '\0';
+		}
+		line = line_end;
+	}
+}
+
+// check the checksum of an IGC file (see chksum_igc_file()) and read its environment
+CHKSUM_RESULT igc_env_file(char chksum[CHKSUM_CHARS+1], char *filepath, IgcEnv *env) {
+	CHKSUM_RESULT result;
+	MappedFile mf;
+
+	if (!map_file(&mf, filepath)) {
+		memset(env, 0, sizeof(IgcEnv));
+		return chksum_igc_file(chksum, filepath, env->chksum[IGC_ENV_GENERAL]);
+	}
+	igc_env_data(env, mf.data, mf.size);
+	result = chksum_igc_data(chksum, mf.data, mf.size, env->chksum[IGC_ENV_GENERAL]);
+	unmap_file(&mf);
+	return result;
+}
+
+//*******************************************************************************
+//**************** RESUMABLE CHECKSUM / LIVE TAIL OF A GROWING IGC FILE *********
+//
+// A checkpoint holds the checksum state over the first 'offset' bytes of an
+// IGC file, so a file that is still arriving can be verified by processing
+// only what has been appended since the last look. It can be saved to disk
+// (as <igc file>.chk) so the verifier itself can be restarted.
+
+const size_t CHKSUM_TAIL_BUF = 65536; // read size for chksum_igc_resume()
+const int CHKSUM_TAIL_POLL = 500; // default milliseconds between looks at a tailed file
+
+struct ChksumCheckpoint {
+	ChksumData chk;	// checksum of the file up to offset
+	__int64 offset;	// bytes of the file already checksummed
+	int in_line;	// non-zero if offset is part way through an over-long line
+};
+
+void chksum_checkpoint_reset(ChksumCheckpoint *cp) {
+	chksum_reset(&cp->chk);
+	cp->offset = 0;
+	cp->in_line = 0;
+}
+
+bool chksum_checkpoint_save(ChksumCheckpoint *cp, char *filepath) {
+	FILE *f;
+	if (fopen_s(&f, filepath, "w")!=0) return false;
+	fprintf(f, "sim_logger checkpoint 1\n%lld %d %d", cp->offset, cp->in_line, cp->chk.index);
+	for (int i=0; i<CHKSUM_CHARS; i++) fprintf(f, " %d", cp->chk.num[i]);
+	fprintf(f, "\n");
+	return fclose(f)==0;
+}
+
+// returns false (and a reset checkpoint) if the file is missing or not a valid checkpoint
+bool chksum_checkpoint_load(ChksumCheckpoint *cp, char *filepath) {
+	FILE *f;
+	char line_buf[MAXBUF];
+	int n;
+	bool ok;
+
+	chksum_checkpoint_reset(cp);
+	if (fopen_s(&f, filepath, "r")!=0) return false;
+	ok = fgets(line_buf, MAXBUF, f)!=NULL && strcmp(line_buf, "sim_logger checkpoint 1\n")==0 &&
+		 fscanf_s(f, "%lld %d %d", &cp->offset, &cp->in_line, &cp->chk.index)==3 &&
+		 cp->offset>=0 && cp->chk.index>=0 && cp->chk.index<CHKSUM_MAX_INDEX;
+	for (int i=0; ok && i<CHKSUM_CHARS; i++) {
+		ok = fscanf_s(f, "%d", &n)==1 && n>=0 && n<CHK_CHARS;
+		cp->chk.num[i] = n;
+	}
+	fclose(f);
+	if (!ok) chksum_checkpoint_reset(cp);
+	return ok;
+}
+
+// Continue checking an IGC file from checkpoint cp. Only complete lines are
+// checksummed, so cp->offset always ends up at the start of the first line
+// still to be processed. Returns CHKSUM_NOT_FOUND until the 'G' record has
+// arrived, then the same result chksum_igc_file() would give.
+CHKSUM_RESULT chksum_igc_resume(ChksumCheckpoint *cp, char chksum[CHKSUM_CHARS+1], char *filepath) {
+	FILE *f;
+	char *buf;
+	size_t count;
+	bool progress = true;
+	CHKSUM_RESULT result = CHKSUM_NOT_FOUND;
+
+	// share the file with the program still writing it, fopen_s() would deny it write access
+	f = _fsopen(filepath, "rb", _SH_DENYNO);
+	if (f==NULL) return CHKSUM_FILE_ERROR;
+	// a file shorter than what we've checked has been replaced, so start again
+	_fseeki64(f, 0, SEEK_END);
+	if (_ftelli64(f)<cp->offset) chksum_checkpoint_reset(cp);
+
+	buf = (char *)malloc(CHKSUM_TAIL_BUF);
+	if (buf==NULL) {
+		fclose(f);
+		return CHKSUM_FILE_ERROR;
+	}
+	while (result==CHKSUM_NOT_FOUND && progress) {
+		_fseeki64(f, cp->offset, SEEK_SET);
+		count = fread(buf, sizeof(char), CHKSUM_TAIL_BUF, f);
+		const char *line = buf;
+		const char *end = buf + count;
+		progress = false;
+
+		while (line<end) {
+			const char *line_end = (const char *)memchr(line, '\n', end-line);
+			if (!cp->in_line && line[0]=='G') {
+				// G record: wait for the newline unless the checksum chars are all here
+				size_t g_len = (line_end==NULL) ? end-line : line_end-line+1;
+				if (line_end!=NULL && line_end>line && line_end[-1]=='\r') g_len--;
+				if (line_end==NULL && g_len<CHKSUM_CHARS+1) break;
+				if (g_len<CHKSUM_CHARS+1) {
+					result = CHKSUM_TOO_SHORT;
+					break;
+				}
+				chksum_to_string(chksum, cp->chk);
+				result = (strncmp(chksum, line+1, CHKSUM_CHARS)==0) ? CHKSUM_OK : CHKSUM_BAD;
+				break;
+			}
+			if (line_end==NULL) {
+				// take a line longer than the whole buffer in pieces, otherwise wait for the rest
+				if (line==buf && count==CHKSUM_TAIL_BUF) {
+					chksum_bytes(&cp->chk, line, end-line);
+					cp->offset += end-line;
+					cp->in_line = 1;
+					progress = true;
+				}
+				break;
+			}
+			if (!cp->in_line && line_end-line>=13 && strncmp(line,"L FSX GENERAL", 13)==0) 
+				printf("%.*s",(int)(line_end-line-5),line+6);
+			chksum_bytes(&cp->chk, line, line_end-line+1);
+			cp->offset += line_end-line+1;
+			cp->in_line = 0;
+			progress = true;
+			line = line_end+1;
+		}
+	}
+	free(buf);
+	fclose(f);
+	return result;
+}
+
+// print the outcome of checking an IGC file
+void print_chksum_result(CHKSUM_RESULT result, char *filepath) {
+	switch (result)
+	{
+		case CHKSUM_OK:
+			printf("IGC file checks OK.\n");
+			break;
+
+		case CHKSUM_TOO_SHORT:
+			printf("BAD CHECKSUM. This file contains a checksum but it is too short.\n");
+			break;
+
+		case CHKSUM_NOT_FOUND:
+			printf("BAD CHECKSUM. This file does not contain a 'G' record.\n");
+			break;
+
+		case CHKSUM_BAD:
+			printf("BAD CHECKSUM. 'G' record found but checksum is wrong.\n");
+			break;
+
+		case CHKSUM_FILE_ERROR:
+			printf("FILE ERROR. Couldn't read the igc file \"%s\".\n", filepath);
+			break;
+	}
+}
+
+// Follow an IGC file that is still being written (e.g. arriving over a slow
+// link) until its 'G' record arrives. Progress is checkpointed in <filepath>.chk
+// so a restarted verifier carries on where it left off.
+CHKSUM_RESULT tail_file(char *filepath, int poll_ms) {
+	char chksum[CHKSUM_CHARS+1] = "000000";
+	char cp_path[MAXBUF];
+	char dir[MAXBUF];
+	ChksumCheckpoint cp;
+	CHKSUM_RESULT result;
+	__int64 saved_offset;
+	HANDLE change;
+
+	sprintf_s(cp_path, MAXBUF, "%s.chk", filepath);
+	if (chksum_checkpoint_load(&cp, cp_path) && debug) printf("Resuming \"%s\" at byte %lld\n", filepath, cp.offset);
+	saved_offset = cp.offset;
+
+	// wake up on writes in the file's folder, with poll_ms as a backstop
+	strcpy_s(dir, MAXBUF, filepath);
+	char *slash = strrchr(dir, '\\');
+	if (slash!=NULL) slash[1] = '\0';
+	else strcpy_s(dir, MAXBUF, ".");
+	change = FindFirstChangeNotificationA(dir, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | 
+													  FILE_NOTIFY_CHANGE_SIZE | 
+													  FILE_NOTIFY_CHANGE_LAST_WRITE);
+
+	// the file may not even exist yet, so keep waiting on a file error too
+	while ((result = chksum_igc_resume(&cp, chksum, filepath))==CHKSUM_NOT_FOUND || 
+		   result==CHKSUM_FILE_ERROR) {
+		if (cp.offset!=saved_offset) {
+			chksum_checkpoint_save(&cp, cp_path);
+			saved_offset = cp.offset;
+			if (debug) printf("\"%s\" checked to byte %lld\n", filepath, cp.offset);
+		}
+		if (change==INVALID_HANDLE_VALUE) Sleep(poll_ms);
+		else if (WaitForSingleObject(change, poll_ms)==WAIT_OBJECT_0) FindNextChangeNotification(change);
+	}
+	if (change!=INVALID_HANDLE_VALUE) FindCloseChangeNotification(change);
+	_unlink(cp_path);
+	return result;
+}
+
+//*******************************************************************************
+//**************** BATCH VERIFICATION OF IGC ARCHIVES ***************************
+//
+// "batch <folder|wildcard|file> ..." checks every file named across a pool of
+// worker threads and prints a tab-separated line per file as it completes:
+//   path  result  general checksum  milliseconds
+// Folders are searched, including sub-folders, for *.igc files.
+// "validate ..." does the same with igc_validate_file(), adding a column with
+// the number of structural errors, which are listed on stderr as
+//   path(line): error: message
+// "index ..." also reads each file's environment for the index file (see below).
+
+struct BatchFile {
+	char *path;
+	CHKSUM_RESULT result;
+	char general[CHKSUM_CHARS+1]; // value of the "L FSX GENERAL CHECKSUM" line
+	double ms;
+	int errors;  // structural errors found when validating
+	IgcEnv *env; // environment read when indexing, else NULL
+};
+
+struct BatchList {
+	BatchFile *files;
+	int count;
+	int size;
+	int dropped;        // files left out for lack of memory, counted as failed
+	volatile LONG next; // index of the next file for a worker to take
+	bool validate;      // check the structure as well as the checksum
+	bool index;         // read each file's environment
+	double freq;        // performance counter ticks per millisecond
+	CRITICAL_SECTION output;
+};
+
+void batch_add_file(BatchList *list, const char *path) {
+	if (list->count==list->size) {
+		int size = (list->size==0) ? 256 : list->size*2;
+		BatchFile *files = (BatchFile *)realloc(list->files, size*sizeof(BatchFile));
+		if (files==NULL) {
+			fprintf(stderr, "%s: error: out of memory, not checked\n", path);
+			list->dropped++;
+			return;
+		}
+		list->files = files;
+		list->size = size;
+	}
+	BatchFile *bf = &list->files[list->count++];
+	bf->path = _strdup(path);
+	bf->result = CHKSUM_FILE_ERROR;
+	bf->general[0] = '\0';
+	bf->ms = 0;
+	bf->errors = 0;
+	bf->env = NULL;
+}
+
+// add the files matching pattern (wildcards allowed in its last part), searching
+// any folders that match for *.igc files
+void batch_add_matches(BatchList *list, const char *pattern, bool igc_only) {
+	WIN32_FIND_DATAA fd;
+	char dir[MAXBUF];
+	char path[MAXBUF];
+	HANDLE h;
+
+	// folder part of the pattern, up to the last '\\' or '/'
+	strcpy_s(dir, MAXBUF, pattern);
+	size_t dir_len = strlen(dir);
+	while (dir_len>0 && dir[dir_len-1]!='\\' && dir[dir_len-1]!='/') dir_len--;
+	dir[dir_len] = '\0';
+
+	h = FindFirstFileA(pattern, &fd);
+	if (h==INVALID_HANDLE_VALUE) return;
+	do {
+		size_t len = strlen(fd.cFileName);
+		if (strcmp(fd.cFileName,".")==0 || strcmp(fd.cFileName,"..")==0) continue;
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			// don't follow junctions, they can loop
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+			sprintf_s(path, MAXBUF, "%s%s\\*", dir, fd.cFileName);
+			batch_add_matches(list, path, true);
+		}
+		else if (!igc_only || (len>4 && _stricmp(fd.cFileName+len-4, ".igc")==0)) {
+			sprintf_s(path, MAXBUF, "%s%s", dir, fd.cFileName);
+			batch_add_file(list, path);
+		}
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+}
+
+// add a command line argument: a file, a folder or a wildcard
+void batch_add(BatchList *list, const char *arg) {
+	char pattern[MAXBUF];
+
+	if (strpbrk(arg, "*?")!=NULL) {
+		batch_add_matches(list, arg, false);
+		return;
+	}
+	DWORD attr = GetFileAttributesA(arg);
+	if (attr!=INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)) {
+		size_t len = strlen(arg);
+		if (len>0 && (arg[len-1]=='\\' || arg[len-1]=='/')) len--;
+		sprintf_s(pattern, MAXBUF, "%.*s\\*", (int)len, arg);
+		batch_add_matches(list, pattern, true);
+	}
+	else batch_add_file(list, arg); // a missing file is reported as a file error
+}
+
+DWORD WINAPI batch_thread(LPVOID param) {
+	BatchList *list = (BatchList *)param;
+	char chksum[CHKSUM_CHARS+1];
+	LARGE_INTEGER t0, t1;
+	IgcErrors errs;
+	LONG k;
+
+	while ((k = InterlockedIncrement(&list->next)-1) < list->count) {
+		BatchFile *bf = &list->files[k];
+		QueryPerformanceCounter(&t0);
+		if (list->validate) {
+			bf->result = igc_validate_file(chksum, bf->path, bf->general, &errs);
+			bf->errors = errs.count;
+		}
+		else if (list->index && (bf->env = (IgcEnv *)malloc(sizeof(IgcEnv)))!=NULL) {
+			bf->result = igc_env_file(chksum, bf->path, bf->env);
+			strcpy_s(bf->general, CHKSUM_CHARS+1, bf->env->chksum[IGC_ENV_GENERAL]);
+		}
+		else bf->result = chksum_igc_file(chksum, bf->path, bf->general);
+		QueryPerformanceCounter(&t1);
+		bf->ms = (t1.QuadPart-t0.QuadPart)/list->freq;
+
+		EnterCriticalSection(&list->output);
+		printf("%s\t%s\t%s\t%.3f", bf->path, chksum_result_names[bf->result], 
+			   bf->general[0] ? bf->general : "-", bf->ms);
+		if (list->validate) {
+			printf("\t%d", bf->errors);
+			for (int e=0; e<errs.count && e<IGC_MAX_ERRORS; e++)
+				fprintf(stderr, "%s(%d): error: %s\n", bf->path, errs.line[e], errs.msg[e]);
+			if (errs.count>IGC_MAX_ERRORS) 
+				fprintf(stderr, "%s: %d more errors\n", bf->path, errs.count-IGC_MAX_ERRORS);
+		}
+		printf("\n");
+		fflush(stdout);
+		LeaveCriticalSection(&list->output);
+	}
+	return 0;
+}
+
+// check every file in the list, returns the number that didn't check OK
+int batch_check(BatchList *list) {
+	LARGE_INTEGER freq, t0, t1;
+	int failed = list->dropped;
+
+	if (list->count==0) {
+		if (failed==0) fprintf(stderr, "No IGC files found\n");
+		return failed;
+	}
+	QueryPerformanceFrequency(&freq);
+	list->freq = freq.QuadPart/1000.0;
+	list->next = 0;
+	InitializeCriticalSection(&list->output);
+
+	QueryPerformanceCounter(&t0);
+	printf(list->validate ? "path\tresult\tgeneral\tms\terrors\n" : "path\tresult\tgeneral\tms\n");
+	// every worker shares the one list
+	int threads = worker_count();
+	if (threads>list->count) threads = list->count;
+	run_threads(batch_thread, list, 0, threads);
+	QueryPerformanceCounter(&t1);
+
+	for (int k=0; k<list->count; k++) {
+		if (list->files[k].result!=CHKSUM_OK || list->files[k].errors>0) failed++;
+	}
+	fprintf(stderr, "%d files checked in %.1f s, %d OK, %d failed\n", list->count+list->dropped, 
+			(t1.QuadPart-t0.QuadPart)/(list->freq*1000), list->count+list->dropped-failed, failed);
+	DeleteCriticalSection(&list->output);
+	return failed;
+}
+
+void batch_free(BatchList *list) {
+	for (int k=0; k<list->count; k++) {
+		free(list->files[k].path);
+		free(list->files[k].env);
+	}
+	free(list->files);
+	list->files = NULL;
+	list->count = list->size = 0;
+}
+
+//*******************************************************************************
+//**************** INDEX OF FLIGHT ENVIRONMENTS *********************************
+//
+// "index <folder|wildcard|file> ..." saves the environment of every log checked
+// to an index file ('index=<path>', default sim_logger.idx), a line per log:
+//   flt  wx  cmx  mission  cfg  air  general  pilot  result  path
+// "query <reference igc file>" loads the index and lists the logs whose
+// environment differs from the reference log's, a line per log:
+//   pilot  path  field=value,...
+// ('fields=wx,cfg' to compare only some checksums, default all but general).
+// Logs are grouped by environment in a hash table, so each distinct
+// environment is compared with the reference once.
+
+char *igc_index_path = "sim_logger.idx";
+char *igc_index_header = "sim_logger index 1";
+
+struct IgcIndexEntry {
+	IgcEnv env;
+	CHKSUM_RESULT result;
+	char *path;
+	int next; // next entry with the same environment checksums, -1 at the end
+};
+
+struct IgcIndex {
+	IgcIndexEntry *entries;
+	int count;
+	int size;
+	int *table;     // first entry of each environment, -1 if empty
+	int table_size; // a power of 2
+	int groups;     // number of distinct environments
+};
+
+void igc_index_save(BatchList *list, char *filepath) {
+	FILE *f;
+
+	if (fopen_s(&f, filepath, "w")!=0) {
+		fprintf(stderr, "Couldn't write index \"%s\"\n", filepath);
+		return;
+	}
+	fprintf(f, "%s\n", igc_index_header);
+	for (int k=0; k<list->count; k++) {
+		IgcEnv *env = list->files[k].env;
+		if (env==NULL) continue;
+		for (int i=0; i<IGC_ENV_COUNT; i++) fprintf(f, "%s\t", env->chksum[i][0] ? env->chksum[i] : "-");
+		fprintf(f, "%s\t%s\t%s\n", env->pilot[0] ? env->pilot : "-", 
+				chksum_result_names[list->files[k].result], list->files[k].path);
+	}
+	fclose(f);
+}
+
+unsigned int igc_env_hash(IgcEnv *env) {
+	unsigned int h = 2166136261u; // FNV-1a over the checksums
+	for (int i=0; i<IGC_ENV_COUNT; i++) {
+		for (const char *c=env->chksum[i]; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+		h = (h ^ '\t') * 16777619u;
+	}
+	return h;
+}
+
+bool igc_env_equal(IgcEnv *a, IgcEnv *b) {
+	for (int i=0; i<IGC_ENV_COUNT; i++) if (strcmp(a->chksum[i], b->chksum[i])!=0) return false;
+	return true;
+}
+
+// add entry k to its environment's group, growing the table as needed,
+// false if there's no memory to grow it (the table is left as it was)
+bool igc_index_group(IgcIndex *index, int k) {
+	if (index->groups*2>=index->table_size) {
+		int size = (index->table_size==0) ? 64 : index->table_size*2;
+		int *table = (int *)malloc(size*sizeof(int));
+		if (table==NULL) return false;
+		for (int i=0; i<size; i++) table[i] = -1;
+		for (int i=0; i<index->table_size; i++) {
+			int first = index->table[i];
+			if (first<0) continue;
+			unsigned int h = igc_env_hash(&index->entries[first].env) & (size-1);
+			while (table[h]>=0) h = (h+1) & (size-1);
+			table[h] = first;
+		}
+		free(index->table);
+		index->table = table;
+		index->table_size = size;
+	}
+	IgcIndexEntry *e = &index->entries[k];
+	unsigned int h = igc_env_hash(&e->env) & (index->table_size-1);
+	while (index->table[h]>=0 && !igc_env_equal(&index->entries[index->table[h]].env, &e->env))
+		h = (h+1) & (index->table_size-1);
+	if (index->table[h]<0) index->groups++;
+	e->next = index->table[h];
+	index->table[h] = k;
+	return true;
+}
+
+void igc_index_free(IgcIndex *index) {
+	for (int k=0; k<index->count; k++) free(index->entries[k].path);
+	free(index->entries);
+	free(index->table);
+	memset(index, 0, sizeof(IgcIndex));
+}
+
+bool igc_index_load(IgcIndex *index, char *filepath) {
+	FILE *f;
+	char line[MAXBUF+200];
+	char *field[IGC_ENV_COUNT+3];
+
+	memset(index, 0, sizeof(IgcIndex));
+	if (fopen_s(&f, filepath, "r")!=0) return false;
+	if (fgets(line, sizeof(line), f)==NULL || strncmp(line, igc_index_header, strlen(igc_index_header))!=0) {
+		fclose(f);
+		return false;
+	}
+	while (fgets(line, sizeof(line), f)!=NULL) {
+		// split into the tab separated fields, the path is the rest of the line
+		char *p = line;
+		int n = 0;
+		for (; n<IGC_ENV_COUNT+2; n++) {
+			char *tab = strchr(p, '\t');
+			if (tab==NULL) break;
+			*tab = '\0';
+			field[n] = p;
+			p = tab+1;
+		}
+		if (n<IGC_ENV_COUNT+2) continue;
+		p[strcspn(p, "\r\n")] = '\0';
+		field[n] = p;
+
+		if (index->count==index->size) {
+			int size = (index->size==0) ? 256 : index->size*2;
+			IgcIndexEntry *entries = (IgcIndexEntry *)realloc(index->entries, size*sizeof(IgcIndexEntry));
+			if (entries==NULL) break;
+			index->entries = entries;
+			index->size = size;
+		}
+		IgcIndexEntry *e = &index->entries[index->count];
+		memset(&e->env, 0, sizeof(IgcEnv));
+		for (int i=0; i<IGC_ENV_COUNT; i++) 
+			if (strcmp(field[i],"-")!=0) strncpy_s(e->env.chksum[i], CHKSUM_CHARS+1, field[i], CHKSUM_CHARS);
+		if (strcmp(field[IGC_ENV_COUNT],"-")!=0) 
+			strncpy_s(e->env.pilot, IGC_PILOT_CHARS+1, field[IGC_ENV_COUNT], IGC_PILOT_CHARS);
+		e->result = CHKSUM_FILE_ERROR;
+		for (int r=0; r<_countof(chksum_result_names); r++)
+			if (strcmp(field[IGC_ENV_COUNT+1], chksum_result_names[r])==0) e->result = (CHKSUM_RESULT)r;
+		e->path = _strdup(field[IGC_ENV_COUNT+2]);
+		index->count++;
+		if (!igc_index_group(index, index->count-1)) {
+			printf("Not enough memory for the index\n");
+			fclose(f);
+			igc_index_free(index);
+			return false;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+// fields from a list such as "wx,cfg", as a bit per IGC_ENV, 0 if a name is unknown
+unsigned int igc_env_fields(char *names) {
+	unsigned int fields = 0;
+	char *p = names;
+
+	while (*p) {
+		size_t n = strcspn(p, ",");
+		int i = 0;
+		while (i<IGC_ENV_COUNT && (strlen(igc_env_names[i])!=n || _strnicmp(p, igc_env_names[i], n)!=0)) i++;
+		if (i==IGC_ENV_COUNT) return 0;
+		fields |= 1<<i;
+		p += n;
+		if (*p==',') p++;
+	}
+	return fields;
+}
+
+// list the logs in the index whose environment differs from the reference log's
+int igc_index_query(char *reference, char *index_path, unsigned int fields) {
+	IgcIndex index;
+	IgcEnv ref;
+	char chksum[CHKSUM_CHARS+1];
+	char diff[MAXBUF];
+	int differ = 0;
+	int differ_groups = 0;
+
+	if (igc_env_file(chksum, reference, &ref)==CHKSUM_FILE_ERROR) {
+		printf("FILE ERROR. Couldn't read the igc file \"%s\".\n", reference);
+		return 1;
+	}
+	if (!igc_index_load(&index, index_path)) {
+		printf("Couldn't read index \"%s\"\n", index_path);
+		return 1;
+	}
+	printf("pilot\tpath\tdiffers\n");
+	for (int h=0; h<index.table_size; h++) {
+		int first = index.table[h];
+		if (first<0) continue;
+		IgcEnv *env = &index.entries[first].env;
+		diff[0] = '\0';
+		for (int i=0; i<IGC_ENV_COUNT; i++) {
+			if (!(fields & (1<<i)) || strcmp(env->chksum[i], ref.chksum[i])==0) continue;
+			if (diff[0]) strcat_s(diff, MAXBUF, ",");
+			strcat_s(diff, MAXBUF, igc_env_names[i]);
+			strcat_s(diff, MAXBUF, "=");
+			strcat_s(diff, MAXBUF, env->chksum[i][0] ? env->chksum[i] : "-");
+		}
+		if (!diff[0]) continue;
+		differ_groups++;
+		for (int k=first; k>=0; k=index.entries[k].next) {
+			printf("%s\t%s\t%s\n", index.entries[k].env.pilot[0] ? index.entries[k].env.pilot : "-", 
+				   index.entries[k].path, diff);
+			differ++;
+		}
+	}
+	fprintf(stderr, "%d of %d logs differ from the reference, in %d of %d environments\n", 
+			differ, index.count, differ_groups, index.groups);
+	igc_index_free(&index);
+	return 0;
+}
+
+//*******************************************************************************
+//**************** VERIFICATION SERVICE ON A LOCAL SOCKET ***********************
+//
+// "serve" listens on a Unix domain socket ('socket=<path>' on the command line,
+// default sim_logger.sock) and checks IGC files for any number of clients on a
+// pool of worker threads. Each request is a line:
+//   FILE <path>      check the file at path
+//   DATA <length>    check the <length> bytes of IGC data following the line
+// Requests are numbered from 1 on each connection and may be pipelined. The
+// reply to each is sent as soon as it has been checked, so may come out of order:
+//   number  path (or -)  result  general checksum  milliseconds
+// A request that can't be understood gets "number  ERROR  reason".
+
+char *daemon_socket = "sim_logger.sock";
+const size_t DAEMON_MAX_DATA = 64*1024*1024; // largest DATA request
+const int DAEMON_BUF = 65536; // receive buffer per connection
+
+struct DaemonConn {
+	SOCKET s;
+	volatile LONG refs; // the reader thread plus each queued request
+	CRITICAL_SECTION send_lock;
+	char buf[DAEMON_BUF];
+	int buf_start;
+	int buf_end;
+};
+
+struct DaemonJob {
+	DaemonJob *next;
+	DaemonConn *conn;
+	int seq;
+	char *path; // file to check, or NULL to check data
+	char *data;
+	size_t size;
+};
+
+// requests waiting for a worker
+struct DaemonQueue {
+	CRITICAL_SECTION lock;
+	HANDLE ready; // semaphore counting the jobs in the queue
+	DaemonJob *head;
+	DaemonJob *tail;
+} daemon_queue;
+
+void daemon_release(DaemonConn *conn) {
+	if (InterlockedDecrement(&conn->refs)==0) {
+		closesocket(conn->s);
+		DeleteCriticalSection(&conn->send_lock);
+		free(conn);
+	}
+}
+
+void daemon_send(DaemonConn *conn, const char *s, int len) {
+	EnterCriticalSection(&conn->send_lock);
+	while (len>0) {
+		int n = send(conn->s, s, len, 0);
+		if (n<=0) break; // client has gone, the reader will see it
+		s += n;
+		len -= n;
+	}
+	LeaveCriticalSection(&conn->send_lock);
+}
+
+// refill the connection's buffer, false at end of connection
+bool daemon_fill(DaemonConn *conn) {
+	if (conn->buf_start==conn->buf_end) conn->buf_start = conn->buf_end = 0;
+	int n = recv(conn->s, conn->buf+conn->buf_end, DAEMON_BUF-conn->buf_end, 0);
+	if (n<=0) return false;
+	conn->buf_end += n;
+	return true;
+}
+
+// read a line, without its line end, false at end of connection or if longer than max-1
+bool daemon_read_line(DaemonConn *conn, char *line, int max) {
+	int len = 0;
+
+	while (true) {
+		char *start = conn->buf+conn->buf_start;
+		int avail = conn->buf_end-conn->buf_start;
+		char *nl = (char *)memchr(start, '\n', avail);
+		int n = (nl==NULL) ? avail : (int)(nl-start);
+		if (len+n>=max) return false;
+		memcpy(line+len, start, n);
+		len += n;
+		conn->buf_start += (nl==NULL) ? n : n+1;
+		if (nl!=NULL) break;
+		if (!daemon_fill(conn)) return false;
+	}
+	if (len>0 && line[len-1]=='\r') len--;
+	line[len] = '\0';
+	return true;
+}
+
+// read exactly len bytes
+bool daemon_read(DaemonConn *conn, char *dest, size_t len) {
+	while (len>0) {
+		if (conn->buf_start==conn->buf_end && !daemon_fill(conn)) return false;
+		size_t n = conn->buf_end-conn->buf_start;
+		if (n>len) n = len;
+		memcpy(dest, conn->buf+conn->buf_start, n);
+		conn->buf_start += (int)n;
+		dest += n;
+		len -= n;
+	}
+	return true;
+}
+
+void daemon_push(DaemonJob *job) {
+	job->next = NULL;
+	EnterCriticalSection(&daemon_queue.lock);
+	if (daemon_queue.tail==NULL) daemon_queue.head = job;
+	else daemon_queue.tail->next = job;
+	daemon_queue.tail = job;
+	LeaveCriticalSection(&daemon_queue.lock);
+	ReleaseSemaphore(daemon_queue.ready, 1, NULL);
+}
+
+DWORD WINAPI daemon_worker(LPVOID param) {
+	char chksum[CHKSUM_CHARS+1];
+	char general[CHKSUM_CHARS+1];
+	char reply[MAXBUF+100];
+	LARGE_INTEGER freq, t0, t1;
+
+	QueryPerformanceFrequency(&freq);
+	while (WaitForSingleObject(daemon_queue.ready, INFINITE)==WAIT_OBJECT_0) {
+		EnterCriticalSection(&daemon_queue.lock);
+		DaemonJob *job = daemon_queue.head;
+		daemon_queue.head = job->next;
+		if (daemon_queue.head==NULL) daemon_queue.tail = NULL;
+		LeaveCriticalSection(&daemon_queue.lock);
+
+		QueryPerformanceCounter(&t0);
+		CHKSUM_RESULT result = (job->path!=NULL) ? chksum_igc_file(chksum, job->path, general) :
+												   chksum_igc_data(chksum, job->data, job->size, general);
+		QueryPerformanceCounter(&t1);
+		int n = sprintf_s(reply, sizeof(reply), "%d\t%s\t%s\t%s\t%.3f\n", job->seq, 
+						  (job->path!=NULL) ? job->path : "-", chksum_result_names[result],
+						  general[0] ? general : "-", (t1.QuadPart-t0.QuadPart)*1000.0/freq.QuadPart);
+		if (n>0) daemon_send(job->conn, reply, n);
+
+		daemon_release(job->conn);
+		free(job->path);
+		free(job->data);
+		free(job);
+	}
+	return 0;
+}
+
+// read the requests on one connection and queue them for the workers
+DWORD WINAPI daemon_reader(LPVOID param) {
+	DaemonConn *conn = (DaemonConn *)param;
+	char line[MAXBUF];
+	char reply[100];
+	int seq = 0;
+	char *reason;
+
+	while (daemon_read_line(conn, line, MAXBUF)) {
+		if (line[0]=='\0') continue;
+		seq++;
+		DaemonJob *job = (DaemonJob *)calloc(1, sizeof(DaemonJob));
+		if (job==NULL) break;
+		job->conn = conn;
+		job->seq = seq;
+		reason = NULL;
+		if (strncmp(line,"FILE ",5)==0) {
+			job->path = _strdup(line+5);
+			if (job->path==NULL) reason = "out of memory";
+		}
+		else if (strncmp(line,"DATA ",5)==0) {
+			char *end;
+			job->size = (size_t)_strtoui64(line+5, &end, 10);
+			if (end==line+5 || *end!='\0' || job->size>DAEMON_MAX_DATA) reason = "bad DATA length";
+			else if ((job->data = (char *)malloc(job->size+1))==NULL) reason = "out of memory";
+			else if (!daemon_read(conn, job->data, job->size)) {
+				free(job->data);
+				free(job);
+				break;
+			}
+		}
+		else reason = "unknown request";
+
+		if (reason!=NULL) {
+			int n = sprintf_s(reply, sizeof(reply), "%d\tERROR\t%s\n", seq, reason);
+			daemon_send(conn, reply, n);
+			free(job->path);
+			free(job->data);
+			free(job);
+			// the rest of the stream can't be trusted after a bad DATA request
+			if (strncmp(line,"DATA ",5)==0) break;
+			continue;
+		}
+		InterlockedIncrement(&conn->refs);
+		daemon_push(job);
+	}
+	daemon_release(conn);
+	return 0;
+}
+
+// run the verification service, only returns if it can't start
+int serve(char *socket_path) {
+	WSADATA wsa;
+	SOCKET listener;
+	struct sockaddr_un addr;
+	int threads = worker_count();
+
+	if (WSAStartup(MAKEWORD(2,2), &wsa)!=0) {
+		printf("Couldn't start Windows sockets\n");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path)>=sizeof(addr.sun_path)) {
+		printf("Socket path \"%s\" is too long\n", socket_path);
+		return 1;
+	}
+	strcpy_s(addr.sun_path, sizeof(addr.sun_path), socket_path);
+	_unlink(socket_path); // left behind by an earlier run
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener==INVALID_SOCKET || 
+		bind(listener, (struct sockaddr *)&addr, sizeof(addr))==SOCKET_ERROR || 
+		listen(listener, SOMAXCONN)==SOCKET_ERROR) {
+		printf("Couldn't listen on \"%s\"\n", socket_path);
+		if (listener!=INVALID_SOCKET) closesocket(listener);
+		WSACleanup();
+		return 1;
+	}
+
+	InitializeCriticalSection(&daemon_queue.lock);
+	daemon_queue.ready = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	daemon_queue.head = daemon_queue.tail = NULL;
+	for (int k=0; k<threads; k++) {
+		HANDLE h = CreateThread(NULL, 0, daemon_worker, NULL, 0, NULL);
+		if (h!=NULL) CloseHandle(h);
+	}
+	printf("Checking IGC files on \"%s\" with %d threads\n", socket_path, threads);
+
+	while (true) {
+		SOCKET s = accept(listener, NULL, NULL);
+		if (s==INVALID_SOCKET) continue;
+		DaemonConn *conn = (DaemonConn *)malloc(sizeof(DaemonConn));
+		if (conn==NULL) {
+			closesocket(s);
+			continue;
+		}
+		conn->s = s;
+		conn->refs = 1;
+		conn->buf_start = conn->buf_end = 0;
+		InitializeCriticalSection(&conn->send_lock);
+		HANDLE h = CreateThread(NULL, 0, daemon_reader, conn, 0, NULL);
+		if (h==NULL) daemon_release(conn);
+		else CloseHandle(h);
+	}
+}
+
+// this routine produces a general checksum for the
+// FLT, WX, CMX, AIR, aircraft.cfg files
+// so if this is correct the user does not have to look at the 
+// individual checksums
+CHKSUM_RESULT chksum_chksum(char chksum[CHKSUM_CHARS+1]) {
+	ChksumData chk_data;
+
+	chksum_reset(&chk_data);
+
+	chksum_string(&chk_data,chksum_flt);
+	chksum_string(&chk_data,chksum_air);
+	chksum_string(&chk_data,chksum_wx);
+	chksum_string(&chk_data,chksum_cmx);
+	chksum_string(&chk_data,chksum_cfg);
+	chksum_string(&chk_data,chksum_xml);
+	if (cx_code==0) 
+		chksum_string(&chk_data, "CX UNLOCKED");
+	else
+		chksum_string(&chk_data, "CX LOCKED");
+
+	if (wx_code==0) 
+		chksum_string(&chk_data, "WX UNLOCKED");
+	else
+		chksum_string(&chk_data, "WX LOCKED");
+
+    if (therm_code==0)
+        chksum_string(&chk_data, "THERM FILE PRESENT");
+    else
+        chksum_string(&chk_data, "NO THERM FILE");
+
+	chksum_to_string(chksum, chk_data);
+	return CHKSUM_OK;
+}
+
+//*******************************************************************
+//*******************************************************************
+//******************    PARSE THE PLN FILE **************************
+//*******************************************************************
+
+// utility function - copy 'n' chars from src to dest
+void cpy(char *dest, int max, char *src, int n) {
+    if (n>max) return;
+    for (int i=0;i<n;i++) dest[i]=src[i];
+    return;
+}
+
+// this very useful function converts in(UNICODE) to s(ascii) and strips odd chars
+void clean_string(char *s, wchar_t *in) {
+	unsigned int i = 0;
+    const wchar_t *PLN_WCHARS = L"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz.<>, ";
+	while (i<wcslen(in)) {
+        if (wcschr(PLN_WCHARS,in[i])==NULL) 
+			s[i] = ' ';
+		else
+			s[i] = char(in[i]);
+		i++;
+    }
+	s[i] = '\0';
+}
+
+CHKSUM_RESULT pln_to_c(char *filepath) {
+	FILE *f;
+	errno_t err;
+
+	char line_buf[MAXBUF];
+    char s[MAXBUF]; // general buffer
+	wchar_t in_buf[MAXCHAR*4]; // line input buffer
+
+    char *ptr_value; // temporary pointer into read line from PLN
+    char *ptr_end; // temp pointer to end of value
+    int value_length; // length of value up to following '<' char
+
+    char lat_NS = ' ';
+    int lat_degs = 0;
+    int lat_mins = 0;
+    float lat_secs = 0;
+    char long_NS = ' ';
+    int long_degs = 0;
     int long_mins = 0;
     float long_secs = 0;
     char comma = ','; // temp placeholder for sscanf_s
@@ -641,141 +2315,1138 @@ CHKSUM_RESULT pln_to_c(char *filepath) {
 		for (int i=0; i<c_wp_count; i++) printf("WP:             %s",c[i+2]);
 		printf("landing:        %s",c_landing);
 	}
-	return CHKSUM_OK;
+	return CHKSUM_OK;
+
+}
+
+
+//*******************************************************************
+//**************** find short filename      *************************
+
+void path_to_name(char name[MAXBUF], char path[MAXBUF]) {
+	int i;
+	bool found1 = false; // flag to say we've found 1st '\' char
+	bool found2 = false;
+
+	// first check if file is there
+    if(_access_s(path, 0) != 0) {
+        strcpy_s(name, MAXBUF,"not found");
+        return;
+	}
+
+	// ok we've found the file, so lets abbreviate the name
+	i = strlen(path);
+	while (i>0 && !found2) {
+		if (path[--i]=='\\') { 
+			if (!found1) found1 = true;
+			else found2 = true;
+		}
+	}	
+	strcpy_s(name, MAXBUF,path+i+1);
+}
+
+//*******************************************************************
+//*****************  SIMCONNECT             *************************
+//*******************************************************************
+//*******************************************************************
+
+//*******************************************************************
+// igc file logger vars
+//*******************************************************************
+const int IGC_TICK_COUNT = 4; // log every 4 seconds
+const INT32 IGC_MIN_RECORDS = 4; // don't record an IGC file if it is short
+const INT32 IGC_MIN_FLIGHT_SECS_TO_LANDING = 80; // don't trigger a log save on landing unless
+                                                 // airborne for at least 80 seconds
+
+int igc_tick_counter = 0; // variable to keep track of how many ticks we've counted 0..IGC_TICK_COUNT
+INT32 igc_record_count = 0; // count of how many 'B' records we've recorded
+
+INT32 igc_takeoff_time; // note time of last "SIM ON GROUND"->!(SIM ON GROUND) transition
+INT32 igc_prev_on_ground = 0;
+
+bool igc_split = false; // "split" flag - save a log for each flight when it lands
+int igc_flight_count = 0; // flights saved by "split" this session
+
+//*******************************************************************************
+//**************** TRACK STORE **************************************************
+//
+// The fixes are kept a column at a time in fixed point, 16 bytes a fix and 2 for
+// each extension channel: latitude and longitude in ten millionths of a degree,
+// altitude in decimetres, and ENL and the channels as the B or K record has them,
+// decoded straight from the SimConnect sample. They go in chunks of
+// IGC_CHUNK_FIXES, a page each, taken from a pool, so adding a fix never copies
+// the ones before and a log can be as long as memory allows. A chunk has the
+// full time of its first fix and the change from the one before for the rest,
+// and a change too big for an INT16 starts a new chunk. In the journal the
+// chunks are in the file instead (see TRACK JOURNAL).
+
+const int IGC_CHUNK_FIXES = (4096-12) / (16 + 2*IGC_EXT_CHANNELS); // so a chunk fits in 4096 bytes
+const int IGC_POOL_SLAB = 64;    // chunks allocated at a time by the pool
+
+struct IgcChunk {
+	INT32 key_time; // zulu_time of fix 0
+	INT32 prev_time; // zulu_time of the fix before fix 0, -1 if none
+	INT32 count;
+	INT32 lat[IGC_CHUNK_FIXES]; // 1e-7 degrees
+	INT32 lon[IGC_CHUNK_FIXES]; // 1e-7 degrees
+	INT32 alt[IGC_CHUNK_FIXES]; // decimetres, so alt/10 is int(altitude)
+	INT16 dtime[IGC_CHUNK_FIXES]; // zulu_time less the one before
+	UINT16 enl[IGC_CHUNK_FIXES];  // 0..999
+	INT16 ext[IGC_EXT_CHANNELS][IGC_CHUNK_FIXES]; // igc_channel_int() of the B then K channels
+};
+
+// a fix as the store keeps it
+struct IgcFix {
+	INT32 zulu_time;
+	INT32 lat;
+	INT32 lon;
+	INT32 alt;
+	UINT16 enl;
+	INT16 ext[IGC_EXT_CHANNELS];
+};
+
+// chunks for the stores in memory, shared by the dispatch and writer threads
+struct IgcPool {
+	IgcChunk *free;   // chunks ready to reuse, linked through their first bytes
+	size_t bytes;     // allocated for chunks
+	LONG used;        // chunks in stores
+	LONG peak;        // most chunks in stores at once
+	CRITICAL_SECTION lock;
+};
+
+IgcPool igc_pool = {};
+
+struct IgcStore {
+	INT32 count;
+	INT32 last_time;    // zulu_time of the last fix added
+	IgcChunk **chunks;  // in order
+	INT32 chunk_count;
+	INT32 chunk_size;   // room in chunks
+	IgcChunk *(*new_chunk)(IgcStore *st); // NULL for the pool
+};
+
+// the fixes of the log being recorded
+IgcStore igc_track = {};
+
+void igc_pool_init() {
+	InitializeCriticalSection(&igc_pool.lock);
+}
+
+IgcChunk *igc_pool_get() {
+	IgcChunk *chunk;
+
+	EnterCriticalSection(&igc_pool.lock);
+	if (igc_pool.free==NULL) {
+		IgcChunk *slab = (IgcChunk *)malloc(IGC_POOL_SLAB*sizeof(IgcChunk));
+		if (slab!=NULL) {
+			igc_pool.bytes += IGC_POOL_SLAB*sizeof(IgcChunk);
+			for (int k=0; k<IGC_POOL_SLAB; k++) {
+				*(IgcChunk **)&slab[k] = igc_pool.free;
+				igc_pool.free = &slab[k];
+			}
+		}
+	}
+	chunk = igc_pool.free;
+	if (chunk!=NULL) {
+		igc_pool.free = *(IgcChunk **)chunk;
+		if (++igc_pool.used>igc_pool.peak) igc_pool.peak = igc_pool.used;
+	}
+	LeaveCriticalSection(&igc_pool.lock);
+	return chunk;
+}
+
+void igc_pool_put(IgcChunk *chunk) {
+	EnterCriticalSection(&igc_pool.lock);
+	*(IgcChunk **)chunk = igc_pool.free;
+	igc_pool.free = chunk;
+	igc_pool.used--;
+	LeaveCriticalSection(&igc_pool.lock);
+}
+
+// forget the fixes, giving pool chunks back
+void igc_store_reset(IgcStore *st) {
+	if (st->new_chunk==NULL) {
+		for (INT32 k=0; k<st->chunk_count; k++) igc_pool_put(st->chunks[k]);
+	}
+	st->count = 0;
+	st->chunk_count = 0;
+}
+
+void igc_store_free(IgcStore *st) {
+	igc_store_reset(st);
+	free(st->chunks);
+	memset(st, 0, sizeof(IgcStore));
+}
+
+// room for another chunk, false if out of memory
+bool igc_store_grow(IgcStore *st) {
+	if (st->chunk_count<st->chunk_size) return true;
+	INT32 size = (st->chunk_size<16) ? 16 : st->chunk_size*2;
+	IgcChunk **chunks = (IgcChunk **)realloc(st->chunks, size*sizeof(IgcChunk *));
+	if (chunks==NULL) return false;
+	st->chunks = chunks;
+	st->chunk_size = size;
+	return true;
+}
+
+// start a new chunk at zulu_time, false if out of memory
+bool igc_store_chunk(IgcStore *st, INT32 zulu_time) {
+	if (!igc_store_grow(st)) return false;
+	IgcChunk *chunk = (st->new_chunk==NULL) ? igc_pool_get() : st->new_chunk(st);
+	if (chunk==NULL) return false;
+	chunk->key_time = zulu_time;
+	chunk->prev_time = (st->count>0) ? st->last_time : -1;
+	chunk->count = 0;
+	st->chunks[st->chunk_count++] = chunk;
+	return true;
+}
+
+// add fix f, false if out of memory
+bool igc_store_put(IgcStore *st, const IgcFix *f) {
+	INT32 d = f->zulu_time - st->last_time;
+	IgcChunk *chunk = (st->chunk_count>0) ? st->chunks[st->chunk_count-1] : NULL;
+
+	if (chunk==NULL || chunk->count==IGC_CHUNK_FIXES || d<-32768 || d>32767) {
+		if (!igc_store_chunk(st, f->zulu_time)) return false;
+		chunk = st->chunks[st->chunk_count-1];
+		d = 0;
+	}
+	int i = chunk->count;
+	chunk->lat[i] = f->lat;
+	chunk->lon[i] = f->lon;
+	chunk->alt[i] = f->alt;
+	chunk->dtime[i] = (INT16)d;
+	chunk->enl[i] = f->enl;
+	for (int k=0; k<IGC_EXT_CHANNELS; k++) chunk->ext[k][i] = f->ext[k];
+	chunk->count = i+1;
+	st->last_time = f->zulu_time;
+	st->count++;
+	return true;
+}
+
+// add the fix in sample s, false if out of memory
+bool igc_store_add(IgcStore *st, const IgcSample *s) {
+	const UserStruct *p = &s->pos;
+	IgcFix f;
+
+	f.zulu_time = p->zulu_time;
+	f.lat = (INT32)nearbyint(p->latitude * 1e7);
+	f.lon = (INT32)nearbyint(p->longitude * 1e7);
+	f.alt = (INT32)(p->altitude * 10.0);
+	int rpm = p->rpm;
+	f.enl = (UINT16)(((rpm>9990) ? 9990 : (rpm<0) ? 0 : rpm) / 10); // 999 at most
+	for (int k=0; k<IGC_EXT_CHANNELS; k++) f.ext[k] = igc_channel_int(s, IGC_FIX_CHANNELS+k);
+	return igc_store_put(st, &f);
+}
+
+// copy src into an empty dst from the pool, false if out of memory
+bool igc_store_copy(IgcStore *dst, const IgcStore *src) {
+	memset(dst, 0, sizeof(IgcStore));
+	dst->chunks = (IgcChunk **)malloc((src->chunk_count>0 ? src->chunk_count : 1)*sizeof(IgcChunk *));
+	if (dst->chunks==NULL) return false;
+	dst->chunk_size = src->chunk_count;
+	for (INT32 k=0; k<src->chunk_count; k++) {
+		IgcChunk *chunk = igc_pool_get();
+		if (chunk==NULL) {
+			igc_store_free(dst);
+			return false;
+		}
+		memcpy(chunk, src->chunks[k], sizeof(IgcChunk));
+		dst->chunks[dst->chunk_count++] = chunk;
+	}
+	dst->count = src->count;
+	dst->last_time = src->last_time;
+	return true;
+}
+
+// the zulu_time of each fix in chunk
+void igc_chunk_times(const IgcChunk *chunk, INT32 *t) {
+	INT32 time = chunk->key_time;
+
+	for (int i=0; i<chunk->count; i++) {
+		time += chunk->dtime[i];
+		t[i] = time;
+	}
+}
+
+// the memory st and the pool are using, for debug
+void igc_store_print(const char *name, const IgcStore *st) {
+	printf("%s: %d fixes in %d chunks (%.0f KB), pool %.0f KB with %d chunks in use, %d at most\n", 
+		   name, st->count, st->chunk_count, st->chunk_count*sizeof(IgcChunk)/1024.0, 
+		   igc_pool.bytes/1024.0, igc_pool.used, igc_pool.peak);
+}
+
+//**********************************************************************************
+//******* IGC FILE ROUTINES                                                 ********
+//**********************************************************************************
+//**********************************************************************************
+
+//*******************************************************************************
+//**************** SUBSCRIPTIONS ************************************************
+//
+// Every SimConnect_RequestDataOnSimObject() goes through igc_subscribe(), which
+// keeps what each request is set to and doesn't ask again for what is already
+// in place: a periodic request with the same settings, or a once request still
+// waiting for its reply. Positions are asked for with the CHANGED and TAGGED
+// flags, so a second with nothing new sends nothing and otherwise only the
+// channels that changed come, as datum id and value pairs. igc_pos_sample()
+// puts them over the last sample to make the whole sample again. 'updates=all'
+// asks for the whole sample every second as before.
+
+const ULONGLONG IGC_SUBSCRIBE_RETRY_MS = 5000; // a once request with no reply by then is asked again
+
+struct IgcSubscription {
+	DWORD definition;
+	SIMCONNECT_PERIOD period; // SIMCONNECT_PERIOD_NEVER when not asked for
+	DWORD flags;
+	DWORD interval;           // periods between sends, 0 for every period
+	ULONGLONG asked;          // GetTickCount64() when it was asked for
+	LONG requests;            // made to SimConnect
+	LONG repeats;             // not made as they were already in place
+	LONG replies;
+	ULONGLONG bytes;          // in the replies
+};
+
+IgcSubscription igc_subscriptions[REQUEST_COUNT] = {};
+
+// 'updates=all' on command line for 0
+DWORD igc_pos_flags = SIMCONNECT_DATA_REQUEST_FLAG_CHANGED | SIMCONNECT_DATA_REQUEST_FLAG_TAGGED;
+
+IgcSample igc_pos_last;  // the channels as they last came
+DWORD igc_pos_known = 0; // bit k set once channel k has come
+
+// forget the requests of the last connection
+void igc_subscriptions_reset() {
+	memset(igc_subscriptions, 0, sizeof(igc_subscriptions));
+	igc_pos_known = 0;
+}
+
+// ask for request to be sent as definition every interval+1 periods, unless it already is
+HRESULT igc_subscribe(DATA_REQUEST_ID request, DWORD definition, SIMCONNECT_PERIOD period, DWORD flags, DWORD interval) {
+	IgcSubscription *sub = &igc_subscriptions[request];
+	ULONGLONG now = GetTickCount64();
+
+	if (sub->period==period && sub->definition==definition && sub->flags==flags && sub->interval==interval &&
+		(period!=SIMCONNECT_PERIOD_ONCE || now-sub->asked<IGC_SUBSCRIBE_RETRY_MS)) {
+		sub->repeats++;
+		return S_OK;
+	}
+	HRESULT hr = SimConnect_RequestDataOnSimObject(hSimConnect, request, definition, SIMCONNECT_OBJECT_ID_USER,
+												   period, flags, 0, interval);
+	if (FAILED(hr)) return hr;
+	sub->definition = definition;
+	sub->period = period;
+	sub->flags = flags;
+	sub->interval = interval;
+	sub->asked = now;
+	sub->requests++;
+	return hr;
+}
+
+// count a reply of cb bytes to request, after which a once request can be asked again
+void igc_subscription_reply(DATA_REQUEST_ID request, DWORD cb) {
+	IgcSubscription *sub = &igc_subscriptions[request];
+
+	sub->replies++;
+	sub->bytes += cb;
+	if (sub->period==SIMCONNECT_PERIOD_ONCE) sub->period = SIMCONNECT_PERIOD_NEVER;
+}
+
+void igc_subscriptions_print() {
+	for (int k=0; k<REQUEST_COUNT; k++) {
+		IgcSubscription *sub = &igc_subscriptions[k];
+		printf("Request %d: asked %d times, %d repeats not sent, %d replies, %.0f bytes\n",
+			   k, sub->requests, sub->repeats, sub->replies, (double)sub->bytes);
+	}
+}
+
+// the sample in a REQUEST_USER_POS reply of cbData bytes, where it is if the
+// reply has the whole sample, else the last one with the tagged channels put
+// over it, or NULL until every channel has come
+const IgcSample *igc_pos_sample(SIMCONNECT_RECV_SIMOBJECT_DATA *pObjData, DWORD cbData) {
+	igc_subscription_reply(REQUEST_USER_POS, cbData);
+	if ((pObjData->dwFlags & SIMCONNECT_DATA_REQUEST_FLAG_TAGGED)==0) return (const IgcSample*)&pObjData->dwData;
+
+	const char *p = (const char *)&pObjData->dwData;
+	const char *end = (const char *)pObjData + cbData;
+	for (DWORD k=0; k<pObjData->dwDefineCount; k++) {
+		DWORD id;
+		if (end-p<(int)sizeof(id)) break;
+		memcpy(&id, p, sizeof(id));
+		p += sizeof(id);
+		if (id>=(DWORD)IGC_CHANNELS || end-p<igc_channel_size(id)) break;
+		memcpy(igc_pos_last.data+igc_channels[id].offset, p, igc_channel_size(id));
+		igc_pos_known |= 1<<id;
+		p += igc_channel_size(id);
+	}
+	return (igc_pos_known==(1<<IGC_CHANNELS)-1) ? &igc_pos_last : NULL;
+}
+
+void get_aircraft_data() {
+    HRESULT hr;
+    // set data request
+    hr = igc_subscribe(REQUEST_AIRCRAFT_DATA, DEFINITION_AIRCRAFT, SIMCONNECT_PERIOD_ONCE, 0, 0); 
+}
+
+// this routine will be called each time:
+//  * sim start
+//  * change of aircraft
+//  * change of Wx
+
+void get_startup_data() {
+    HRESULT hr;
+    // set data request
+    hr = igc_subscribe(REQUEST_STARTUP_DATA, DEFINITION_STARTUP, SIMCONNECT_PERIOD_ONCE, 0, 0); 
+
+	// now get aircraft data
+	get_aircraft_data();
+}
+
+void get_user_pos_updates() {
+    HRESULT hr;
+    if (debug_calls) printf(" ..entering get_user_pos_updates()..");
+	// set data request, only made the first time
+	hr = igc_subscribe(REQUEST_USER_POS, DEFINITION_USER_POS, SIMCONNECT_PERIOD_SECOND, igc_pos_flags, 0); 
+    if (debug_calls) printf(" ..leaving get_user_pos_updates()..\n");
+}
+
+//*******************************************************************************
+//**************** IGC RECORD WRITER ********************************************
+//
+// Records are formatted straight into one growable buffer and added to the
+// checksum as they go, then the log is handed to a sink in a single write.
+
+struct IgcWriter {
+	char *buf;
+	size_t len;
+	size_t size;
+	bool failed; // out of memory, the log is incomplete
+	ChksumData chk;
+};
+
+// where a formatted log goes
+struct IgcSink {
+	bool (*write)(IgcSink *sink, const char *data, size_t len);
+	FILE *f;     // file sink
+	char *data;  // memory sink, a malloc'd copy of everything written
+	size_t len;
+};
+
+void igc_writer_init(IgcWriter *w, size_t size) {
+	w->buf = (char *)malloc(size);
+	w->len = 0;
+	w->size = (w->buf==NULL) ? 0 : size;
+	w->failed = (w->buf==NULL);
+	chksum_reset(&w->chk);
+}
+
+void igc_writer_free(IgcWriter *w) {
+	free(w->buf);
+	w->buf = NULL;
+	w->len = w->size = 0;
+}
+
+bool igc_writer_grow(IgcWriter *w, size_t size) {
+	if (w->failed) return false;
+	if (size<=w->size) return true;
+	char *buf = (char *)realloc(w->buf, size);
+	if (buf==NULL) {
+		w->failed = true;
+		return false;
+	}
+	w->buf = buf;
+	w->size = size;
+	return true;
+}
+
+// add a record formatted as printf() would
+void igc_record(IgcWriter *w, const char *format, ...) {
+	va_list args;
+	int n = -1;
+
+	while (!w->failed) {
+		if (w->size-w->len>1) {
+			va_start(args, format);
+			n = _vsnprintf_s(w->buf+w->len, w->size-w->len, _TRUNCATE, format, args);
+			va_end(args);
+			if (n>=0) break;
+			// no record is anything like this long, so the format itself is bad
+			if (w->size-w->len>16*MAXBUF) return;
+		}
+		igc_writer_grow(w, w->size*2+MAXBUF);
+	}
+	if (n<0) return;
+	chksum_bytes(&w->chk, w->buf+w->len, n);
+	w->len += n;
+}
+
+// add n chars of records that are already formatted
+void igc_record_bytes(IgcWriter *w, const char *s, size_t n) {
+	if (w->len+n>w->size && !igc_writer_grow(w, w->size*2+n)) return;
+	memcpy(w->buf+w->len, s, n);
+	chksum_bytes(&w->chk, s, n);
+	w->len += n;
+}
+
+// add a record that is already formatted, e.g. a C record
+void igc_record_text(IgcWriter *w, const char *s) {
+	igc_record_bytes(w, s, strlen(s));
+}
+
+// add the G record, which isn't part of its own checksum
+void igc_record_g(IgcWriter *w) {
+	char chksum[CHKSUM_CHARS+1];
+	ChksumData chk = w->chk;
+
+	chksum_to_string(chksum, chk);
+	igc_record(w, "G%s\n", chksum);
+	w->chk = chk;
+}
+
+bool igc_sink_file_write(IgcSink *sink, const char *data, size_t len) {
+	return fwrite(data, 1, len, sink->f)==len;
+}
+
+bool igc_sink_memory_write(IgcSink *sink, const char *data, size_t len) {
+	char *p = (char *)realloc(sink->data, sink->len+len);
+	if (p==NULL && sink->len+len>0) return false;
+	memcpy(p+sink->len, data, len);
+	sink->data = p;
+	sink->len += len;
+	return true;
+}
+
+// a FILE opened in text mode ("w") gets "\r\n" line ends, as the log always has
+void igc_sink_file(IgcSink *sink, FILE *f) {
+	memset(sink, 0, sizeof(IgcSink));
+	sink->write = igc_sink_file_write;
+	sink->f = f;
+}
+
+// sink->data collects the log, free() it when done ("bench" writes a whole log this way)
+void igc_sink_memory(IgcSink *sink) {
+	memset(sink, 0, sizeof(IgcSink));
+	sink->write = igc_sink_memory_write;
+}
+
+// write what has been formatted so far to sink and empty the buffer,
+// the checksum carries on over the records added after this
+bool igc_writer_flush(IgcWriter *w, IgcSink *sink) {
+	if (w->failed) return false;
+	bool ok = sink->write(sink, w->buf, w->len);
+	w->len = 0;
+	return ok;
+}
+
+//*******************************************************************************
+//**************** B RECORD ENCODER *********************************************
+//
+// A B record is the fixed 35 char IGC layout plus the FXA and ENL extensions
+// of the I record, then the B channels. A K record with the K channels follows
+// the first fix of a log and the first in each IGC_K_INTERVAL. igc_b_encode()
+// writes them with a table of digit pairs rather than parsing a format, giving
+// the same bytes as the sprintf_s() formats in igc_b_sprintf(), which it falls
+// back to for any field too big for its width.
+
+const int IGC_B_MAX = 128; // room for any B record and its K record, even with oversized fields
+const INT32 IGC_K_INTERVAL = 60; // seconds
+
+// the fields of a B record
+struct IgcBRecord {
+	int hours;
+	int minutes;
+	int secs;
+	int lat_DD;
+	int lat_MM;
+	int lat_mmm;
+	char NS;
+	int long_DDD;
+	int long_MM;
+	int long_mmm;
+	char EW;
+	int altitude;
+	int FXA;
+	int ENL;
+	int ext[IGC_B_CHANNELS];
+	bool k_due;               // a K record follows
+	int k_ext[IGC_K_CHANNELS];
+};
+
+const INT32 IGC_B_PARALLEL_MIN = 8192; // logs with fewer fixes are formatted on one thread
+
+// DD, MM and mmm of a coordinate in ten millionths of a degree, rounded to the
+// nearest thousandth of a minute, so 52.9999999 is 53 00 000 rather than 52 59 999.
+// The products and quotients are exact or correctly rounded, so this gives the
+// same result as igc_coord_avx2().
+inline void igc_coord(INT32 e7, int *DD, int *MM, int *mmm) {
+	double t = nearbyint(fabs(e7 * 6.0) / 1000.0); // thousandths of a minute
+	double d = floor(t / 60000.0);
+	double r = t - d * 60000.0;
+	double m = floor(r / 1000.0);
+	*DD = (int)d;
+	*MM = (int)m;
+	*mmm = (int)(r - m * 1000.0);
+}
+
+// the same steps as igc_coord() for 4 coordinates
+inline void igc_coord_avx2(__m128i e7, int DD[4], int MM[4], int mmm[4]) {
+	const __m256d k60000 = _mm256_set1_pd(60000.0);
+	const __m256d k1000 = _mm256_set1_pd(1000.0);
+	__m256d x = _mm256_andnot_pd(_mm256_set1_pd(-0.0), _mm256_mul_pd(_mm256_cvtepi32_pd(e7), _mm256_set1_pd(6.0)));
+	__m256d t = _mm256_round_pd(_mm256_div_pd(x, k1000), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256d d = _mm256_floor_pd(_mm256_div_pd(t, k60000));
+	__m256d r = _mm256_sub_pd(t, _mm256_mul_pd(d, k60000));
+	__m256d m = _mm256_floor_pd(_mm256_div_pd(r, k1000));
+	_mm_storeu_si128((__m128i *)DD, _mm256_cvttpd_epi32(d));
+	_mm_storeu_si128((__m128i *)MM, _mm256_cvttpd_epi32(m));
+	_mm_storeu_si128((__m128i *)mmm, _mm256_cvttpd_epi32(_mm256_sub_pd(r, _mm256_mul_pd(m, k1000))));
+}
+
+// true if a K record follows the fix at zulu_time, prev_time being the fix before it or -1
+inline bool igc_k_due(INT32 prev_time, INT32 zulu_time) {
+	return prev_time<0 || prev_time/IGC_K_INTERVAL!=zulu_time/IGC_K_INTERVAL;
+}
+
+// the fields other than the position, of fix i of chunk c at zulu_time,
+// prev_time being the fix before it
+inline void igc_b_other_fields(IgcBRecord *b, const IgcChunk *c, int i, INT32 zulu_time, INT32 prev_time) {
+	b->hours = zulu_time / 3600;
+	b->minutes = (zulu_time - b->hours * 3600 ) / 60;
+	b->secs = zulu_time % 60;
+	// written without branches, signs are as likely to change as not
+	b->NS = (char)('S' - ('S'-'N')*(c->lat[i]>0));
+	b->EW = (char)('W' - ('W'-'E')*(c->lon[i]>0));
+	b->altitude = c->alt[i] / 10;
+	b->FXA = 27;
+	b->ENL = c->enl[i];
+	for (int k=0; k<IGC_B_CHANNELS; k++) b->ext[k] = c->ext[k][i];
+	b->k_due = igc_k_due(prev_time, zulu_time);
+	for (int k=0; k<IGC_K_CHANNELS; k++) b->k_ext[k] = c->ext[IGC_B_CHANNELS+k][i];
+}
+
+void igc_b_fields(IgcBRecord *b, const IgcChunk *c, int i, INT32 zulu_time, INT32 prev_time) {
+	igc_b_other_fields(b, c, i, zulu_time, prev_time);
+	igc_coord(c->lat[i], &b->lat_DD, &b->lat_MM, &b->lat_mmm);
+	igc_coord(c->lon[i], &b->long_DDD, &b->long_MM, &b->long_mmm);
+}
+
+// fields of all the fixes of chunk c, 4 at a time straight from the columns with AVX2
+void igc_b_convert(IgcBRecord *b, const IgcChunk *c) {
+	INT32 t[IGC_CHUNK_FIXES];
+	int count = c->count;
+	int k = 0;
+
+	igc_chunk_times(c, t);
+	if (chksum_simd==CHKSUM_SIMD_AVX2) {
+		int DD[8], MM[8], mmm[8];
+		for (; k+4<=count; k+=4) {
+			igc_coord_avx2(_mm_loadu_si128((const __m128i *)(c->lat+k)), DD, MM, mmm);
+			igc_coord_avx2(_mm_loadu_si128((const __m128i *)(c->lon+k)), DD+4, MM+4, mmm+4);
+			for (int i=0; i<4; i++) {
+				igc_b_other_fields(&b[k+i], c, k+i, t[k+i], (k+i>0) ? t[k+i-1] : c->prev_time);
+				b[k+i].lat_DD = DD[i];
+				b[k+i].lat_MM = MM[i];
+				b[k+i].lat_mmm = mmm[i];
+				b[k+i].long_DDD = DD[i+4];
+				b[k+i].long_MM = MM[i+4];
+				b[k+i].long_mmm = mmm[i+4];
+			}
+		}
+	}
+	for (; k<count; k++) igc_b_fields(&b[k], c, k, t[k], (k>0) ? t[k-1] : c->prev_time);
+}
+
+// fields of all the fixes in st, into b with room for st->count
+void igc_b_convert_all(IgcBRecord *b, const IgcStore *st) {
+	for (INT32 k=0; k<st->chunk_count; k++) {
+		igc_b_convert(b, st->chunks[k]);
+		b += st->chunks[k]->count;
+	}
+}
+
+// write the B record and any K record at p (IGC_B_MAX chars) with sprintf_s, returns their length
+int igc_b_sprintf(char *p, IgcBRecord *b) {
+//	sprintf_s(s,MAXBUF,     "B %02.2d %02.2d %02.2d %02.2d %02.2d %03.3d %c %03.3d %02.2d %03.3d %c A %05.5d %05.5d 000\n",
+	// altitudes are %05d not %05.5d, so below sea level is '-' and 4 digits as IGC expects
+	int n = sprintf_s(p, IGC_B_MAX, "B%02.2d%02.2d%02.2d%02.2d%02.2d%03.3d%c%03.3d%02.2d%03.3d%cA%05d%05d%03.3d%03.3d",
+				    b->hours, b->minutes, b->secs,
+					b->lat_DD, b->lat_MM, b->lat_mmm, b->NS,
+					b->long_DDD, b->long_MM, b->long_mmm, b->EW,
+					b->altitude, b->altitude, b->FXA, b->ENL);
+	for (int k=0; k<IGC_B_CHANNELS; k++)
+		n += sprintf_s(p+n, IGC_B_MAX-n, "%0*d", igc_channels[IGC_FIX_CHANNELS+k].width, b->ext[k]);
+	n += sprintf_s(p+n, IGC_B_MAX-n, "\n");
+	if (b->k_due) {
+		n += sprintf_s(p+n, IGC_B_MAX-n, "K%02.2d%02.2d%02.2d", b->hours, b->minutes, b->secs);
+		for (int k=0; k<IGC_K_CHANNELS; k++)
+			n += sprintf_s(p+n, IGC_B_MAX-n, "%0*d", igc_channels[IGC_FIX_CHANNELS+IGC_B_CHANNELS+k].width, b->k_ext[k]);
+		n += sprintf_s(p+n, IGC_B_MAX-n, "\n");
+	}
+	return n;
+}
+
+const char igc_digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+							   "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+							   "8081828384858687888990919293949596979899";
+
+inline void igc_put2(char *p, int v) {
+	memcpy(p, igc_digit_pairs+2*v, 2);
+}
+
+inline void igc_put3(char *p, int v) {
+	p[0] = (char)('0' + v/100);
+	igc_put2(p+1, v%100);
+}
+
+inline void igc_put5(char *p, int v) {
+	p[0] = (char)('0' + v/10000);
+	igc_put2(p+1, v/100%100);
+	igc_put2(p+3, v%100);
+}
+
+// v in width chars, after a '-' when negative (igc_channel_int() keeps it in range)
+inline int igc_put_field(char *p, int v, int width) {
+	int n = width;
+	if (v<0) {
+		*p++ = '-';
+		v = -v;
+		width--;
+	}
+	for (int k=width-1; k>=0; k--) {
+		p[k] = (char)('0' + v%10);
+		v /= 10;
+	}
+	return n;
+}
+
+// write the B record and any K record at p (IGC_B_MAX chars), returns their length
+int igc_b_encode(char *p, IgcBRecord *b) {
+	// oversized fields get sprintf_s()'s extra chars
+	if (((unsigned int)b->hours>99) | ((unsigned int)b->minutes>99) | ((unsigned int)b->secs>99) |
+		((unsigned int)b->lat_DD>99) | ((unsigned int)b->lat_MM>99) | ((unsigned int)b->lat_mmm>999) |
+		((unsigned int)b->long_DDD>999) | ((unsigned int)b->long_MM>99) | ((unsigned int)b->long_mmm>999) |
+		((unsigned int)(b->altitude+9999)>99999+9999) | ((unsigned int)b->FXA>999) | ((unsigned int)b->ENL>999))
+		return igc_b_sprintf(p, b);
+
+	p[0] = 'B';
+	igc_put2(p+1, b->hours);
+	igc_put2(p+3, b->minutes);
+	igc_put2(p+5, b->secs);
+	igc_put2(p+7, b->lat_DD);
+	igc_put2(p+9, b->lat_MM);
+	igc_put3(p+11, b->lat_mmm);
+	p[14] = b->NS;
+	igc_put3(p+15, b->long_DDD);
+	igc_put2(p+18, b->long_MM);
+	igc_put3(p+20, b->long_mmm);
+	p[23] = b->EW;
+	p[24] = 'A';
+	if (b->altitude>=0) {
+		igc_put5(p+25, b->altitude);
+		igc_put5(p+30, b->altitude);
+	} else {
+		igc_put_field(p+25, b->altitude, 5);
+		igc_put_field(p+30, b->altitude, 5);
+	}
+	igc_put3(p+35, b->FXA);
+	igc_put3(p+38, b->ENL);
+	int n = IGC_B_LEN;
+	for (int k=0; k<IGC_B_CHANNELS; k++) n += igc_put_field(p+n, b->ext[k], igc_channels[IGC_FIX_CHANNELS+k].width);
+	p[n++] = '\n';
+	if (b->k_due) {
+		p[n] = 'K';
+		igc_put2(p+n+1, b->hours);
+		igc_put2(p+n+3, b->minutes);
+		igc_put2(p+n+5, b->secs);
+		n += 7;
+		for (int k=0; k<IGC_K_CHANNELS; k++)
+			n += igc_put_field(p+n, b->k_ext[k], igc_channels[IGC_FIX_CHANNELS+IGC_B_CHANNELS+k].width);
+		p[n++] = '\n';
+	}
+	return n;
+}
 
+void igc_record_b(IgcWriter *w, IgcBRecord *b) {
+	if (w->len+IGC_B_MAX>w->size && !igc_writer_grow(w, w->size*2+IGC_B_MAX)) return;
+	int n = igc_b_encode(w->buf+w->len, b);
+	chksum_bytes(&w->chk, w->buf+w->len, n);
+	w->len += n;
 }
 
+// the B records for chunks first..first+count-1 of st, formatted by one worker thread
+struct IgcBRange {
+	const IgcStore *st;
+	INT32 first;
+	INT32 count;
+	char *out; // IGC_B_MAX bytes for each fix
+	size_t len;
+};
 
-//*******************************************************************
-//**************** find short filename      *************************
+DWORD WINAPI igc_b_range_thread(LPVOID param) {
+	IgcBRange *range = (IgcBRange *)param;
+	IgcBRecord b[IGC_CHUNK_FIXES];
 
-void path_to_name(char name[MAXBUF], char path[MAXBUF]) {
-	int i;
-	bool found1 = false; // flag to say we've found 1st '\' char
-	bool found2 = false;
+	range->len = 0;
+	for (INT32 k=range->first; k<range->first+range->count; k++) {
+		const IgcChunk *c = range->st->chunks[k];
+		igc_b_convert(b, c);
+		for (int i=0; i<c->count; i++) range->len += igc_b_encode(range->out+range->len, &b[i]);
+	}
+	return 0;
+}
 
-	// first check if file is there
-    if(_access_s(path, 0) != 0) {
-        strcpy_s(name, MAXBUF,"not found");
-        return;
+// add the B records for all the fixes in st. Large logs are formatted a run of
+// chunks to each worker thread, then copied in after each other and checksummed in order.
+void igc_record_b_all(IgcWriter *w, const IgcStore *st) {
+	INT32 count = st->count;
+	int threads = worker_count();
+	IgcBRange *ranges = NULL;
+	char *out = NULL;
+
+	if (threads>1 && count>=IGC_B_PARALLEL_MIN) {
+		ranges = (IgcBRange *)malloc(threads*sizeof(IgcBRange));
+		out = (char *)malloc((size_t)count*IGC_B_MAX);
+	}
+	if (ranges==NULL || out==NULL) {
+		free(ranges);
+		free(out);
+		for (INT32 k=0; k<st->chunk_count; k++) {
+			IgcBRecord b[IGC_CHUNK_FIXES];
+			igc_b_convert(b, st->chunks[k]);
+			for (int i=0; i<st->chunks[k]->count; i++) igc_record_b(w, &b[i]);
+		}
+		return;
 	}
 
-	// ok we've found the file, so lets abbreviate the name
-	i = strlen(path);
-	while (i>0 && !found2) {
-		if (path[--i]=='\\') { 
-			if (!found1) found1 = true;
-			else found2 = true;
+	// whole chunks to each thread, about count/threads fixes each, the last takes what's left
+	INT32 share = count/threads;
+	INT32 chunk = 0;
+	INT32 start = 0;
+	size_t len = 0;
+	for (int k=0; k<threads; k++) {
+		INT32 n = 0;
+		ranges[k].st = st;
+		ranges[k].first = chunk;
+		ranges[k].out = out + (size_t)start*IGC_B_MAX;
+		while (chunk<st->chunk_count && (k==threads-1 || n<share)) n += st->chunks[chunk++]->count;
+		ranges[k].count = chunk - ranges[k].first;
+		start += n;
+	}
+	run_threads(igc_b_range_thread, ranges, sizeof(IgcBRange), threads);
+
+	for (int k=0; k<threads; k++) len += ranges[k].len;
+	if (igc_writer_grow(w, w->len+len)) {
+		char *p = w->buf+w->len;
+		for (int k=0; k<threads; k++) {
+			memcpy(p, ranges[k].out, ranges[k].len);
+			p += ranges[k].len;
 		}
-	}	
-	strcpy_s(name, MAXBUF,path+i+1);
+		chksum_bytes_parallel(&w->chk, w->buf+w->len, len);
+		w->len += len;
+	}
+	free(ranges);
+	free(out);
 }
 
-//*******************************************************************
-//*****************  SIMCONNECT             *************************
-//*******************************************************************
-//*******************************************************************
+// the I record of FXA, ENL then the B channels, from byte 36 of the B records,
+// and the J record of the K channels, from byte 8 of the K records
+void igc_record_extensions(IgcWriter *w) {
+	char buf[MAXBUF];
+	int start = IGC_B_LEN+1;
+	int n = sprintf_s(buf, MAXBUF, "I%02.2d3638FXA3941ENL", 2+IGC_B_CHANNELS);
 
-//*******************************************************************
-// igc file logger vars
-//*******************************************************************
-const int IGC_TICK_COUNT = 4; // log every 4 seconds
-const INT32 IGC_MAX_RECORDS = 40000; // log a maximum of this many 'B' records.
-const INT32 IGC_MIN_RECORDS = 4; // don't record an IGC file if it is short
-const INT32 IGC_MIN_FLIGHT_SECS_TO_LANDING = 80; // don't trigger a log save on landing unless
-                                                 // airborne for at least 80 seconds
+	for (int k=0; k<IGC_B_CHANNELS; k++) {
+		const IgcChannel *ch = &igc_channels[IGC_FIX_CHANNELS+k];
+		n += sprintf_s(buf+n, MAXBUF-n, "%02.2d%02.2d%s", start, start+ch->width-1, ch->code);
+		start += ch->width;
+	}
+	igc_record(w, "%s\n", buf);
+
+	start = 8;
+	n = sprintf_s(buf, MAXBUF, "J%02.2d", IGC_K_CHANNELS);
+	for (int k=0; k<IGC_K_CHANNELS; k++) {
+		const IgcChannel *ch = &igc_channels[IGC_FIX_CHANNELS+IGC_B_CHANNELS+k];
+		n += sprintf_s(buf+n, MAXBUF-n, "%02.2d%02.2d%s", start, start+ch->width-1, ch->code);
+		start += ch->width;
+	}
+	igc_record(w, "%s\n", buf);
+}
 
-int igc_tick_counter = 0; // variable to keep track of how many ticks we've counted 0..IGC_TICK_COUNT
-INT32 igc_record_count = 0; // count of how many 'B' records we've recorded
+// format the records before the first B record into w
+void igc_format_header(IgcWriter *w, struct tm *today) {
+	char buf[MAXBUF];
 
-INT32 igc_takeoff_time; // note time of last "SIM ON GROUND"->!(SIM ON GROUND) transition
-INT32 igc_prev_on_ground = 0;
+	igc_record(w,         "AXXX sim_logger v%.2f\n", version); // manufacturer
+
+	igc_record(w,		   "HFDTE%02.2d%02.2d%02.2d\n", startup_data.zulu_day,     // date
+												startup_data.zulu_month,
+												startup_data.zulu_year % 1000);
+
+	igc_record(w,         "HFFXA035\n");                        // gps accuracy
+	igc_record(w,         "HFPLTPILOTINCHARGE: not recorded\n");
+	igc_record(w,         "HFCM2CREW2: not recorded\n");
+	igc_record(w,         "HFGTYGLIDERTYPE:%s\n", TITLE);
+	igc_record(w,         "HFGIDGLIDERID:%s\n", ATC_ID);
+	igc_record(w,         "HFDTM100GPSDATUM: WGS-1984\n");
+	igc_record(w,         "HFRFWFIRMWAREVERSION: %.2f\n", version);
+	igc_record(w,         "HFRHWHARDWAREVERSION: 2009\n");
+	igc_record(w,         "HFFTYFRTYPE: sim_logger by Ian Forster-Lewis\n");
+	igc_record(w,         "HFGPSGPS:Microsoft Flight Simulator\n");
+	igc_record(w,         "HFPRSPRESSALTSENSOR: Microsoft Flight Simulator\n");
+	igc_record(w,         "HFCIDCOMPETITIONID:%s\n", ATC_ID);
+	igc_record(w,         "HFCCLCOMPETITIONCLASS:Microsoft Flight Simulator\n");
+
+						// extension record to say info at end of 'B' recs
+						// FXA = fix accuracy
+						// SIU = satellites in use
+						// ENL = engine noise level 000-999
+						// then the channels in igc_channels
+	igc_record_extensions(w);
+
+	// Task (C) records
+	if (c_wp_count>1) {
+		igc_record_text(w, c[0]);
+		igc_record_text(w, c[1]);
+		for (int i=0; i<c_wp_count; i++) {
+			igc_record_text(w, c[i+2]);
+		}
+		igc_record_text(w, c_landing);
+	}
 
-// struct of data in an IGC 'B' record
-struct igc_b {
-	INT32 zulu_time;
-	double latitude;
-	double longitude;
-	double altitude;
-    double rpm;
-};
+	// FSX Comment (L) records
+	strftime( buf, 50, "L FSX date/time on users PC:  %Y-%m-%d %H:%M\n", today );            // date
+	igc_record_text(w, buf);
 
-// array to hold all the 'B' records
-igc_b igc_pos[IGC_MAX_RECORDS];
+	//igc_record(w,		   "L FSX FLT filename %s\n", flt_pathname);
+	igc_record(w,		   "L FSX FLT checksum            %s (%s)\n", chksum_flt, flt_name);
 
-//**********************************************************************************
-//******* IGC FILE ROUTINES                                                 ********
-//**********************************************************************************
-//**********************************************************************************
+	//igc_record(w,		   "L FSX PLN filename %s\n", pln_pathname);
+	//igc_record(w,		   "L FSX PLN checksum %s\n", chksum_pln);
 
+	//igc_record(w,		   "L FSX WX filename %s\n", wx_pathname);
+	igc_record(w,		   "L FSX WX checksum             %s (%s)\n", chksum_wx, wx_name);
 
-void igc_reset_log() {
-	//c_wp_count = 0;
-	igc_record_count = 0;
-}
+	//igc_record(w,		   "L FSX CMX filename %s\n", cmx_pathname);
+	igc_record(w,		   "L FSX CMX checksum            %s (%s)\n", chksum_cmx, cmx_name);
 
-void get_aircraft_data() {
-    HRESULT hr;
-    // set data request
-    hr = SimConnect_RequestDataOnSimObject(hSimConnect, 
-                                            REQUEST_AIRCRAFT_DATA, 
-                                            DEFINITION_AIRCRAFT, 
-                                            SIMCONNECT_OBJECT_ID_USER,
-                                            SIMCONNECT_PERIOD_ONCE); 
+	igc_record(w,		   "L FSX mission checksum        %s (%s)\n", chksum_xml, xml_name);
 
-}
+	igc_record(w,		   "L FSX aircraft.cfg checksum   %s (%s)\n", chksum_cfg, cfg_name);
 
-// this routine will be called each time:
-//  * sim start
-//  * change of aircraft
-//  * change of Wx
+	//igc_record(w,		   "L FSX AIR filename %s\n", air_pathname);
+	igc_record(w,		   "L FSX AIR checksum            %s (%s)\n", chksum_air, air_name);
 
-void get_startup_data() {
-    HRESULT hr;
-    // set data request
-    hr = SimConnect_RequestDataOnSimObject(hSimConnect, 
-                                            REQUEST_STARTUP_DATA, 
-                                            DEFINITION_STARTUP, 
-                                            SIMCONNECT_OBJECT_ID_USER,
-                                            SIMCONNECT_PERIOD_ONCE); 
+	// write CumulusX status locked/unlocked
+	if (cx_code==0)
+		igc_record(w,	   "L FSX CumulusX status:        UNLOCKED\n");
+	else
+		igc_record(w,	   "L FSX CumulusX status:        LOCKED OK\n");
 
-	// now get aircraft data
-	get_aircraft_data();
+	// write wx status (unlocked if user has entered weather menu
+	// after a WX file load
+	if (wx_code==0)
+		igc_record(w,	   "L FSX WX status=              UNLOCKED\n");
+	else
+		igc_record(w,	   "L FSX WX status=              LOCKED OK\n");
+
+	// ThermalDescriptions.xml entry
+	if (therm_code==0)
+		igc_record(w,	   "L FSX ThermalDescriptions.xml STILL BEING USED\n");
+	else
+		igc_record(w,	   "L FSX ThermalDescriptions.xml REMOVED OK\n");
+
+	// now calculate a value for the GENERAL CHECKSUM
+	chksum_chksum(chksum_all);
+	igc_record(w,		   "L FSX GENERAL CHECKSUM            %s  <---- CHECK THIS FIRST\n", chksum_all);
 }
 
-void get_user_pos_updates() {
-    HRESULT hr;
-    if (debug_calls) printf(" ..entering get_user_pos_updates()..");
-	// set data request
-	hr = SimConnect_RequestDataOnSimObject(hSimConnect, 
-											REQUEST_USER_POS, 
-											DEFINITION_USER_POS, 
-											SIMCONNECT_OBJECT_ID_USER,
-											SIMCONNECT_PERIOD_SECOND); 
-    if (debug_calls) printf(" ..leaving get_user_pos_updates()..\n");
+// format the whole IGC log into w, ending with its G record,
+// returns the length of the records before the first B record
+size_t igc_format_log(IgcWriter *w, struct tm *today) {
+	igc_format_header(w, today);
+	size_t header_len = w->len;
+
+	// now do the 'B' location records
+	igc_record_b_all(w, &igc_track);
+	igc_record_g(w);
+	return header_len;
 }
 
-void igc_log_point(UserStruct p) {
-	if (igc_record_count<IGC_MAX_RECORDS) {
-		if (igc_record_count==0 || p.zulu_time!=igc_pos[igc_record_count-1].zulu_time) {
-			igc_pos[igc_record_count].latitude = p.latitude;
-			igc_pos[igc_record_count].longitude = p.longitude;
-			igc_pos[igc_record_count].altitude = p.altitude;
-			igc_pos[igc_record_count].zulu_time =p.zulu_time;
-			igc_pos[igc_record_count].rpm =p.rpm;
-			igc_record_count++;
+// true if the validator accepts the len chars of B and K records at out, negative altitudes included
+bool igc_b_bench_check(const char *name, const char *out, size_t out_len) {
+	IgcErrors errs = {};
+	int b_len = IGC_B_LEN, k_len = 7, day_time = -1, below = 0, line_no = 0;
+
+	for (int k=0; k<IGC_B_CHANNELS; k++) b_len += igc_channels[IGC_FIX_CHANNELS+k].width;
+	for (int k=0; k<IGC_K_CHANNELS; k++) k_len += igc_channels[IGC_FIX_CHANNELS+IGC_B_CHANNELS+k].width;
+	for (size_t i=0; i<out_len; ) {
+		const char *line = out+i;
+		size_t len = (const char *)memchr(line, '\n', out_len-i) - line;
+		line_no++;
+		if (line[0]=='B') {
+			if (line[25]=='-') below++;
+			igc_check_b(&errs, line_no, line, len, b_len, &day_time);
 		}
+		else igc_check_k(&errs, line_no, line, len, k_len);
+		i += len+1;
 	}
+	printf("%-10s %d records, %d below sea level, %d validation errors\n", name, line_no, below, errs.count);
+	for (int i=0; i<errs.count && i<IGC_MAX_ERRORS; i++) printf("  line %d: %s\n", errs.line[i], errs.msg[i]);
+	return errs.count==0;
 }
 
-void igc_write_file(char *reason) {
-	FILE *f;
+// "bench" times storing count made up fixes, converting them to B record fields
+// without and with AVX2, then igc_b_sprintf() against igc_b_encode()
+int igc_b_bench(int count) {
+	IgcStore st = {};
+	IgcSample *pos = (IgcSample *)malloc(count*sizeof(IgcSample));
+	IgcBRecord *fixes = (IgcBRecord *)malloc(count*sizeof(IgcBRecord));
+	IgcBRecord *fixes2 = (IgcBRecord *)malloc(count*sizeof(IgcBRecord));
+	char *out1 = (char *)malloc((size_t)count*IGC_B_MAX);
+	char *out2 = (char *)malloc((size_t)count*IGC_B_MAX);
+	unsigned int seed = 12345;
+	size_t len1 = 0, len2 = 0;
+	LARGE_INTEGER freq, t0, t1, t2;
+
+	if (pos==NULL || fixes==NULL || fixes2==NULL || out1==NULL || out2==NULL) {
+		printf("Not enough memory for %d fixes\n", count);
+		free(pos); free(fixes); free(fixes2); free(out1); free(out2);
+		return 1;
+	}
+	// a spread of positions, with some below sea level
+	for (int i=0; i<count; i++) {
+		seed = seed*1103515245 + 12345; pos[i].pos.latitude = (seed>>8) / 16777216.0 * 180.0 - 90.0;
+		seed = seed*1103515245 + 12345; pos[i].pos.longitude = (seed>>8) / 16777216.0 * 360.0 - 180.0;
+		seed = seed*1103515245 + 12345; pos[i].pos.altitude = (seed>>8) % 12000 - 100.0;
+		seed = seed*1103515245 + 12345; pos[i].pos.rpm = (seed>>8) % 12000;
+		pos[i].pos.zulu_time = (i*4) % 86400;
+		// some negative, some too big for their width
+		for (int k=IGC_FIX_CHANNELS; k<IGC_CHANNELS; k++) {
+			seed = seed*1103515245 + 12345; igc_channel_set(&pos[i], k, (seed>>8) % 20000 / 10.0 - 50.0);
+		}
+	}
+	QueryPerformanceFrequency(&freq);
+
+	// the store takes chunks from the pool as it goes, as it does while logging
+	QueryPerformanceCounter(&t0);
+	for (int i=0; i<count; i++) {
+		if (!igc_store_add(&st, &pos[i])) {
+			printf("Not enough memory for %d fixes\n", count);
+			igc_store_free(&st); free(pos); free(fixes); free(fixes2); free(out1); free(out2);
+			return 1;
+		}
+	}
+	QueryPerformanceCounter(&t1);
+	double ns1 = (t1.QuadPart-t0.QuadPart)*1e9/freq.QuadPart/count;
+	printf("%d B records\n", count);
+	printf("store      %7.1f ns/record, %.1f bytes/fix\n", ns1, 
+		   (double)(st.chunk_count*sizeof(IgcChunk) + st.chunk_size*sizeof(IgcChunk *)) / count);
+	igc_store_print("store", &st);
+
+	// zeroed so the padding in the two sets of fields compares equal
+	memset(fixes, 0, count*sizeof(IgcBRecord));
+	memset(fixes2, 0, count*sizeof(IgcBRecord));
+	// a first untimed pass so no timing includes page faults or a cold cache
+	CHKSUM_SIMD simd = chksum_simd;
+	chksum_simd = CHKSUM_SIMD_SCALAR;
+	igc_b_convert_all(fixes, &st);
+	chksum_simd = simd;
+	igc_b_convert_all(fixes2, &st);
+	memset(out1, 0, (size_t)count*IGC_B_MAX);
+	memset(out2, 0, (size_t)count*IGC_B_MAX);
+
+	chksum_simd = CHKSUM_SIMD_SCALAR;
+	QueryPerformanceCounter(&t0);
+	igc_b_convert_all(fixes, &st);
+	QueryPerformanceCounter(&t1);
+	chksum_simd = simd;
+	igc_b_convert_all(fixes2, &st);
+	QueryPerformanceCounter(&t2);
+	ns1 = (t1.QuadPart-t0.QuadPart)*1e9/freq.QuadPart/count;
+	double ns2 = (t2.QuadPart-t1.QuadPart)*1e9/freq.QuadPart/count;
+	bool same_fields = memcmp(fixes, fixes2, count*sizeof(IgcBRecord))==0;
+	printf("convert    %7.1f ns/record\n", ns1);
+	printf("%-10s %7.1f ns/record (%.1fx), fields %s\n", chksum_simd_names[chksum_simd], ns2, ns1/ns2, 
+		   same_fields ? "identical" : "DIFFERENT");
+
+	QueryPerformanceCounter(&t0);
+	for (int i=0; i<count; i++) len1 += igc_b_sprintf(out1+len1, &fixes[i]);
+	QueryPerformanceCounter(&t1);
+	for (int i=0; i<count; i++) len2 += igc_b_encode(out2+len2, &fixes[i]);
+	QueryPerformanceCounter(&t2);
+	ns1 = (t1.QuadPart-t0.QuadPart)*1e9/freq.QuadPart/count;
+	ns2 = (t2.QuadPart-t1.QuadPart)*1e9/freq.QuadPart/count;
+	bool same = len1==len2 && memcmp(out1, out2, len1)==0;
+	printf("sprintf_s  %7.1f ns/record\n", ns1);
+	printf("encoder    %7.1f ns/record (%.1fx), output %s\n", ns2, ns1/ns2, same ? "identical" : "DIFFERENT");
+	bool valid = igc_b_bench_check("sprintf_s", out1, len1) & igc_b_bench_check("encoder", out2, len2);
+
+	// all the B records of a log, on one thread then on the worker threads
+	IgcWriter w1, w2;
+	char chksum1[CHKSUM_CHARS+1], chksum2[CHKSUM_CHARS+1];
+	int threads = worker_threads;
+	igc_writer_init(&w1, (size_t)count*IGC_B_MAX);
+	igc_writer_init(&w2, (size_t)count*IGC_B_MAX);
+	worker_threads = 1;
+	QueryPerformanceCounter(&t0);
+	igc_record_b_all(&w1, &st);
+	QueryPerformanceCounter(&t1);
+	worker_threads = threads;
+	igc_record_b_all(&w2, &st);
+	QueryPerformanceCounter(&t2);
+	chksum_to_string(chksum1, w1.chk);
+	chksum_to_string(chksum2, w2.chk);
+	bool same_log = !w1.failed && !w2.failed && w1.len==w2.len && memcmp(w1.buf, w2.buf, w1.len)==0 &&
+					strcmp(chksum1, chksum2)==0;
+	printf("log        %7.1f ms\n", (t1.QuadPart-t0.QuadPart)*1e3/freq.QuadPart);
+	printf("%2d threads %7.1f ms, output %s\n", worker_count(), (t2.QuadPart-t1.QuadPart)*1e3/freq.QuadPart,
+		   same_log ? "identical" : "DIFFERENT");
+	igc_writer_free(&w1);
+	igc_writer_free(&w2);
+
+	// the whole log into memory rather than a file, then validated as a file would be
+	IgcWriter w3;
+	IgcSink sink;
+	IgcErrors errs;
+	struct tm today = {};
+	igc_writer_init(&w3, 4096 + (size_t)count*IGC_B_MAX);
+	igc_sink_memory(&sink);
+	QueryPerformanceCounter(&t0);
+	igc_format_header(&w3, &today);
+	igc_record_b_all(&w3, &st);
+	igc_record_g(&w3);
+	bool flushed = igc_writer_flush(&w3, &sink);
+	QueryPerformanceCounter(&t1);
+	CHKSUM_RESULT result = flushed ? igc_validate_data(chksum1, sink.data, sink.len, NULL, &errs) : CHKSUM_FILE_ERROR;
+	bool valid_log = result==CHKSUM_OK && errs.count==0;
+	printf("whole log  %7.1f ms, %.1f MB in memory, %s, %d validation errors\n", (t1.QuadPart-t0.QuadPart)*1e3/freq.QuadPart, 
+		   sink.len/1048576.0, chksum_result_names[result], flushed ? errs.count : 0);
+	igc_writer_free(&w3);
+	free(sink.data);
+
+	igc_store_free(&st);
+	free(pos); free(fixes); free(fixes2); free(out1); free(out2);
+	return (same && same_fields && same_log && valid && valid_log) ? 0 : 1;
+}
+
+// look for the files that set up the flight and get their short names for the
+// L records, when a flight, aircraft or flight plan loads, so saving a log
+// doesn't wait on the disk
+void igc_log_names() {
+	path_to_name(flt_name, flt_pathname);
+	path_to_name(air_name, air_pathname);
+	path_to_name(pln_name, pln_pathname);
+	path_to_name(wx_name, wx_pathname);
+	path_to_name(cmx_name, cmx_pathname);
+	path_to_name(cfg_name, cfg_pathname);
+	path_to_name(xml_name, xml_pathname);
+}
+
+// get the log filename in fn, the file names the header records need are
+// already there from igc_log_names(), ThermalDescriptions.xml is checked here
+// so the log records whether it is there when it is saved
+void igc_log_setup(char *fn, char *reason, struct tm *today) {
 	char buf[MAXBUF];
-	char s[MAXBUF]; // buffer to how igc records before writing to file
-	char fn[MAXBUF];
-	errno_t err;
-	ChksumData chk_data;
-	char chksum[CHKSUM_CHARS+1] = "000000";
 
 	if (debug) {
 		printf("flt_pathname=%s\n", flt_pathname);
@@ -791,253 +3462,1164 @@ void igc_write_file(char *reason) {
 		printf("chksum_cfg=%s\n\n", chksum_cfg);
 	}
 
-	path_to_name(flt_name, flt_pathname);
-	path_to_name(air_name, air_pathname);
-	path_to_name(pln_name, pln_pathname);
-	path_to_name(wx_name, wx_pathname);
-	path_to_name(cmx_name, cmx_pathname);
-	path_to_name(cfg_name, cfg_pathname);
-	path_to_name(xml_name, xml_pathname);
+    // check for existence of ThermalDescriptions.xml and set therm_code=0 if so
+    if(_access_s("ThermalDescriptions.xml", 0) != 0) {
+        therm_code = 1;
+    } else {
+        therm_code = 0;
+    }
+    
+	char *flight_fn1 = strrchr(flt_pathname, '\\');
+	if (flight_fn1==NULL) flight_fn1 = flt_pathname;
+	else flight_fn1++;
+	char *dot = strrchr(flight_fn1,'.');
+	char flight_filename[1000];
+	if (dot!=NULL) {
+		//strncpy(flight_fn2, flight_fn1, dot-flight_fn1+1);
+		errno_t err = strncpy_s( flight_filename, _countof(flight_filename), flight_fn1, dot-flight_fn1);
+	} else {
+		errno_t err = strcpy_s( flight_filename, flight_fn1);
+	}
+
+	// make the log filename in fn - file will go in logger.exe folder
+	__time64_t ltime;
+    _time64(&ltime);
+    _localtime64_s( today, &ltime );
+	//strcpy_s(fn, MAXBUF, "\"");
+	//strcat_s(fn, igc_log_directory);
+	strcpy_s(fn, MAXBUF, igc_log_directory);
+	strcat_s(fn, MAXBUF, ATC_ID);
+	strcat_s(fn, MAXBUF, "_");
+	strcat_s(fn, MAXBUF, flight_filename);
+	strftime(buf, MAXBUF, "_%Y-%m-%d_%H%M", today );
+	strcat_s(fn, MAXBUF, buf);
+	if (strlen(reason)>1) {
+		strcat_s(fn, MAXBUF, "(");
+		strcat_s(fn, MAXBUF, reason);
+		strcat_s(fn, MAXBUF, ")");
+	}
+	strcat_s(fn, MAXBUF, ".igc");
+	//strcat_s(fn, "\"");
+}
+
+// show the user whether the log in fn was written
+void igc_show_text(bool written, char *fn) {
+	char file_write_text[200];
+	
+	sprintf_s(file_write_text, 
+			sizeof(file_write_text), 
+			written ? "igc_logger v%.2f wrote %s" : "igc_logger v%.2f could not write log to file \"%s\"", 
+			version, 
+			fn);
+
+	HRESULT hr = SimConnect_Text(hSimConnect, 
+								written ? SIMCONNECT_TEXT_TYPE_PRINT_GREEN : SIMCONNECT_TEXT_TYPE_SCROLL_RED, 
+								written ? 6.0f : 15.0f, 
+								EVENT_MENU_TEXT, //sizeof("TESTING"), "TESTING"); 
+								sizeof(file_write_text), 
+								file_write_text);
+}
+
+// SimConnect is only called from the dispatch thread, so a log written on the
+// ring thread is reported through a queue that the dispatch loop empties with
+// igc_text_done(), as the writer thread's saves are
+
+// a report from the ring thread, waiting for the dispatch loop to show it
+struct IgcText {
+	IgcText *next;
+	bool written;
+	char fn[MAXBUF];
+};
+
+struct IgcTextQueue {
+	IgcText *head;
+	IgcText *tail;
+	CRITICAL_SECTION lock;
+	DWORD thread; // id of the thread whose reports are queued, 0 if none
+};
+
+IgcTextQueue igc_texts = {};
+
+// tell the user whether the log in fn was written
+void igc_write_text(bool written, char *fn) {
+	if (igc_texts.thread==0 || GetCurrentThreadId()!=igc_texts.thread) {
+		igc_show_text(written, fn);
+		return;
+	}
+	IgcText *text = (IgcText *)malloc(sizeof(IgcText));
+	if (text==NULL) return;
+	text->next = NULL;
+	text->written = written;
+	strcpy_s(text->fn, fn);
+	EnterCriticalSection(&igc_texts.lock);
+	if (igc_texts.tail==NULL) igc_texts.head = text;
+	else igc_texts.tail->next = text;
+	igc_texts.tail = text;
+	LeaveCriticalSection(&igc_texts.lock);
+}
+
+// queue the reports from the thread with this id
+void igc_text_start(DWORD thread) {
+	InitializeCriticalSection(&igc_texts.lock);
+	igc_texts.thread = thread;
+}
+
+// called from the dispatch loop, show the reports queued since last time
+void igc_text_done() {
+	if (igc_texts.thread==0) return;
+	EnterCriticalSection(&igc_texts.lock);
+	IgcText *text = igc_texts.head;
+	igc_texts.head = igc_texts.tail = NULL;
+	LeaveCriticalSection(&igc_texts.lock);
+	while (text!=NULL) {
+		IgcText *next = text->next;
+		igc_show_text(text->written, text->fn);
+		free(text);
+		text = next;
+	}
+}
+
+// show what's left once that thread has finished, and report in place again
+void igc_text_stop() {
+	if (igc_texts.thread==0) return;
+	igc_text_done();
+	DeleteCriticalSection(&igc_texts.lock);
+	igc_texts.thread = 0;
+}
+
+//*******************************************************************************
+//**************** STREAMING IGC LOG ********************************************
+//
+// With the "stream" flag the log is opened at the first fix of a flight with
+// its header, C and L records, and each B record is appended as igc_log_point()
+// accepts it, keeping the checksum running. The G record for the records so
+// far always follows the last B record and the next one overwrites it, so the
+// file on disk is a complete log even if the logger dies mid flight, and
+// saving it at the end costs no more than closing it.
+
+bool igc_streaming = false; // "stream" flag
+
+struct IgcStream {
+	FILE *f;      // NULL if no log is being streamed
+	IgcWriter w;  // running checksum, the buffer only holds the latest record
+	IgcSink sink;
+	__int64 g_pos; // where the G record starts
+	bool failed;  // a write failed, the log on disk is incomplete
+	char fn[MAXBUF];
+};
+
+IgcStream igc_stream = {};
+
+// write the G record for the records so far and push it all out of the process
+bool igc_stream_g() {
+	igc_stream.g_pos = _ftelli64(igc_stream.f);
+	igc_record_g(&igc_stream.w);
+	return igc_writer_flush(&igc_stream.w, &igc_stream.sink) && fflush(igc_stream.f)==0;
+}
+
+// open the log and write the records before the first B record
+bool igc_stream_open() {
+	struct tm today;
+
+	igc_log_setup(igc_stream.fn, "", &today);
+	if (debug) printf("\nStreaming IGC file: %s\n", igc_stream.fn);
+
+	// opened shareable so the log can be tailed while it grows
+	igc_stream.f = _fsopen(igc_stream.fn, "w", _SH_DENYWR);
+	if (igc_stream.f==NULL) {
+		igc_write_text(false, igc_stream.fn);
+		return false;
+	}
+	igc_writer_init(&igc_stream.w, 4096);
+	igc_format_header(&igc_stream.w, &today);
+	igc_sink_file(&igc_stream.sink, igc_stream.f);
+	igc_stream.failed = !igc_writer_flush(&igc_stream.w, &igc_stream.sink) || !igc_stream_g();
+	return true;
+}
+
+// write the B record of the one fix in igc_track over the G record, then the new G record
+void igc_stream_point() {
+	IgcBRecord b;
+	const IgcChunk *c = igc_track.chunks[0];
+
+	igc_b_fields(&b, c, 0, c->key_time, c->prev_time);
+	igc_record_b(&igc_stream.w, &b);
+	if (_fseeki64(igc_stream.f, igc_stream.g_pos, SEEK_SET)!=0 ||
+		!igc_writer_flush(&igc_stream.w, &igc_stream.sink) || !igc_stream_g())
+		igc_stream.failed = true;
+}
+
+// close the log, adding "(reason)" to its name as igc_write_file() would,
+// or delete it if it is too short to keep
+bool igc_stream_close(char *reason) {
+	bool written = !igc_stream.failed;
+
+	if (fclose(igc_stream.f)!=0) written = false;
+	igc_stream.f = NULL;
+	igc_writer_free(&igc_stream.w);
+	if (igc_record_count<=IGC_MIN_RECORDS) {
+		if (debug) printf("\nDeleting short IGC file: %s\n", igc_stream.fn);
+		_unlink(igc_stream.fn);
+		return false;
+	}
+	if (reason!=NULL && strlen(reason)>1) {
+		char fn[MAXBUF];
+		strcpy_s(fn, MAXBUF, igc_stream.fn);
+		fn[strlen(fn)-4] = '\0'; // drop ".igc"
+		strcat_s(fn, MAXBUF, "(");
+		strcat_s(fn, MAXBUF, reason);
+		strcat_s(fn, MAXBUF, ").igc");
+		if (rename(igc_stream.fn, fn)==0) strcpy_s(igc_stream.fn, fn);
+	}
+	return written;
+}
+
+// igc_write_file() for a streamed log - a save from the menu just reports the
+// file, which is complete up to the last fix, and logging carries on
+bool igc_stream_write(char *reason) {
+	bool written = !igc_stream.failed;
+
+	if (strlen(reason)>1) written = igc_stream_close(reason);
+	igc_write_text(written, igc_stream.fn);
+	return written;
+}
+
+//*******************************************************************************
+//**************** PACKED TRACK FILES *******************************************
+//
+// With the "pack" flag each saved log also gets a .igcb file beside it, a
+// fraction of the size, which "unpack" turns back into the same .igc byte for
+// byte. It holds the header records as they were written (ATC_ID, TITLE, the C
+// records and the environment checksums), then the fixes as the store has them,
+// a column at a time. Each value is a varint of its difference from a guess: the
+// value before, or for the time and position the value before plus its last
+// step, so a steady glide packs to a byte or two a field. The K channels are only
+// kept for the fixes that have a K record. A streamed log doesn't keep its fixes,
+// so it has no .igcb.
+
+bool igc_pack = false; // "pack" flag - write a .igcb beside each log
+
+const char IGC_PACK_MAGIC[] = "sim_logger igcb 1";
+const int IGC_PACK_COLUMNS = 5 + IGC_EXT_CHANNELS; // time, lat, lon, alt, ENL, then the channels
+
+// how column c is guessed, from the value before (1) or that and its step (2)
+inline int igc_pack_order(int c) {
+	return (c<4) ? 2 : 1;
+}
+
+inline LONGLONG igc_pack_guess(const LONGLONG *v, INT32 i, int order) {
+	if (i==0) return 0;
+	if (i==1 || order==1) return v[i-1];
+	return 2*v[i-1] - v[i-2];
+}
+
+void igc_pack_bytes(IgcWriter *w, const void *p, size_t n) {
+	if (w->len+n>w->size && !igc_writer_grow(w, w->size*2+n)) return;
+	memcpy(w->buf+w->len, p, n);
+	w->len += n;
+}
+
+// 7 bits a byte, low bits first, the top bit set on all but the last
+void igc_pack_varint(IgcWriter *w, ULONGLONG v) {
+	if (w->len+10>w->size && !igc_writer_grow(w, w->size*2+10)) return;
+	while (v>=0x80) {
+		w->buf[w->len++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	w->buf[w->len++] = (char)v;
+}
+
+// the values of column c, only those of fixes with a K record for a K channel,
+// into v with room for st->count, returns how many
+INT32 igc_pack_gather(const IgcStore *st, int c, LONGLONG *v) {
+	INT32 t[IGC_CHUNK_FIXES];
+	INT32 n = 0;
+
+	for (INT32 k=0; k<st->chunk_count; k++) {
+		const IgcChunk *chunk = st->chunks[k];
+		igc_chunk_times(chunk, t);
+		for (int i=0; i<chunk->count; i++) {
+			switch (c) {
+			case 0: v[n++] = t[i]; break;
+			case 1: v[n++] = chunk->lat[i]; break;
+			case 2: v[n++] = chunk->lon[i]; break;
+			case 3: v[n++] = chunk->alt[i]; break;
+			case 4: v[n++] = chunk->enl[i]; break;
+			default:
+				if (c-5<IGC_B_CHANNELS || igc_k_due((i>0) ? t[i-1] : chunk->prev_time, t[i]))
+					v[n++] = chunk->ext[c-5][i];
+			}
+		}
+	}
+	return n;
+}
+
+// write st to the .igcb for the log just written to fn, whose records before
+// the first B record are the header_len chars at header
+bool igc_pack_write(const char *fn, const char *header, size_t header_len, const IgcStore *st) {
+	char path[MAXBUF];
+	IgcWriter w;
+	FILE *f;
+	LONGLONG *v = (LONGLONG *)malloc((st->count>0 ? st->count : 1)*sizeof(LONGLONG));
+	bool written = false;
+
+	sprintf_s(path, MAXBUF, "%sb", fn);
+	igc_writer_init(&w, 4096 + header_len + (size_t)st->count*8);
+	igc_pack_bytes(&w, IGC_PACK_MAGIC, sizeof(IGC_PACK_MAGIC));
+	igc_pack_varint(&w, header_len);
+	igc_pack_bytes(&w, header, header_len);
+	igc_pack_varint(&w, IGC_B_CHANNELS);
+	igc_pack_varint(&w, IGC_K_CHANNELS);
+	for (int k=0; k<IGC_EXT_CHANNELS; k++) igc_pack_varint(&w, igc_channels[IGC_FIX_CHANNELS+k].width);
+	igc_pack_varint(&w, st->count);
+	for (int c=0; c<IGC_PACK_COLUMNS && v!=NULL; c++) {
+		INT32 n = igc_pack_gather(st, c, v);
+		for (INT32 i=0; i<n; i++) {
+			LONGLONG d = v[i] - igc_pack_guess(v, i, igc_pack_order(c));
+			igc_pack_varint(&w, ((ULONGLONG)d << 1) ^ (ULONGLONG)(d >> 63)); // zigzag, small either side of 0
+		}
+	}
+	if (v!=NULL && !w.failed && fopen_s(&f, path, "wb")==0) {
+		written = fwrite(w.buf, 1, w.len, f)==w.len;
+		if (fclose(f)!=0) written = false;
+	}
+	if (debug) printf("\n%s packed track: %s (%d bytes)\n", written ? "Wrote" : "Failed to write", path, (int)w.len);
+	igc_writer_free(&w);
+	free(v);
+	return written;
+}
+
+// reads a .igcb, failed is set by any read past the end or bad value
+struct IgcUnpacker {
+	const unsigned char *p;
+	const unsigned char *end;
+	bool failed;
+};
+
+ULONGLONG igc_unpack_varint(IgcUnpacker *u) {
+	ULONGLONG v = 0;
+
+	for (int shift=0; shift<64 && u->p<u->end; shift+=7) {
+		unsigned char b = *u->p++;
+		v |= (ULONGLONG)(b & 0x7f) << shift;
+		if (b<0x80) return v;
+	}
+	u->failed = true;
+	return 0;
+}
+
+// n values of column c into v, each checked against the range its field holds
+void igc_unpack_column(IgcUnpacker *u, int c, LONGLONG *v, INT32 n) {
+	LONGLONG lo = (c<4) ? -2147483647-1 : (c==4) ? 0 : -32768;
+	LONGLONG hi = (c<4) ? 2147483647 : (c==4) ? 65535 : 32767;
+
+	for (INT32 i=0; i<n && !u->failed; i++) {
+		ULONGLONG z = igc_unpack_varint(u);
+		v[i] = igc_pack_guess(v, i, igc_pack_order(c)) + (LONGLONG)((z >> 1) ^ (0-(z & 1)));
+		if (v[i]<lo || v[i]>hi) u->failed = true;
+	}
+}
+
+// "unpack <file.igcb> [<file.igc>]" writes the log a .igcb was packed from,
+// by default beside it with the name it was packed from
+bool igc_unpack_file(const char *path, const char *out) {
+	MappedFile mf;
+	IgcUnpacker u;
+	IgcStore st = {};
+	IgcFix *fixes = NULL;
+	LONGLONG *v = NULL;
+	char fn[MAXBUF];
+	bool written = false;
+
+	if (out==NULL) {
+		size_t len = strlen(path);
+		if (len>5 && _stricmp(path+len-5, ".igcb")==0) sprintf_s(fn, MAXBUF, "%.*s", (int)len-1, path);
+		else sprintf_s(fn, MAXBUF, "%s.igc", path);
+		out = fn;
+	}
+	if (!map_file(&mf, path)) {
+		printf("Can't read %s\n", path);
+		return false;
+	}
+	u.p = (const unsigned char *)mf.data;
+	u.end = u.p + mf.size;
+	u.failed = mf.size<sizeof(IGC_PACK_MAGIC) || memcmp(u.p, IGC_PACK_MAGIC, sizeof(IGC_PACK_MAGIC))!=0;
+	if (!u.failed) u.p += sizeof(IGC_PACK_MAGIC);
+
+	ULONGLONG header_len = igc_unpack_varint(&u);
+	const char *header = (const char *)u.p;
+	if (header_len>(ULONGLONG)(u.end-u.p)) u.failed = true;
+	else u.p += header_len;
+
+	// the B and K records are laid out by igc_channels, so it has to be the same
+	if (igc_unpack_varint(&u)!=IGC_B_CHANNELS || igc_unpack_varint(&u)!=IGC_K_CHANNELS) u.failed = true;
+	for (int k=0; k<IGC_EXT_CHANNELS && !u.failed; k++)
+		if (igc_unpack_varint(&u)!=(ULONGLONG)igc_channels[IGC_FIX_CHANNELS+k].width) u.failed = true;
+
+	// every fix has at least a byte in each column
+	ULONGLONG count = igc_unpack_varint(&u);
+	if (count>(ULONGLONG)(u.end-u.p)) u.failed = true;
+	if (!u.failed) {
+		fixes = (IgcFix *)malloc((size_t)(count>0 ? count : 1)*sizeof(IgcFix));
+		v = (LONGLONG *)malloc((size_t)(count>0 ? count : 1)*sizeof(LONGLONG));
+	}
+
+	for (int c=0; c<IGC_PACK_COLUMNS && fixes!=NULL && v!=NULL && !u.failed; c++) {
+		INT32 n = (INT32)count;
+		if (c>=5+IGC_B_CHANNELS) {
+			n = 0;
+			for (INT32 i=0; i<(INT32)count; i++) n += igc_k_due((i>0) ? fixes[i-1].zulu_time : -1, fixes[i].zulu_time);
+		}
+		igc_unpack_column(&u, c, v, n);
+		if (c==0) {
+			for (INT32 i=0; i<n && !u.failed; i++) if (v[i]<0) u.failed = true;
+		}
+		INT32 j = 0;
+		for (INT32 i=0; i<(INT32)count && !u.failed; i++) {
+			switch (c) {
+			case 0: fixes[i].zulu_time = (INT32)v[i]; break;
+			case 1: fixes[i].lat = (INT32)v[i]; break;
+			case 2: fixes[i].lon = (INT32)v[i]; break;
+			case 3: fixes[i].alt = (INT32)v[i]; break;
+			case 4: fixes[i].enl = (UINT16)v[i]; break;
+			default:
+				if (c-5<IGC_B_CHANNELS) fixes[i].ext[c-5] = (INT16)v[i];
+				// the fixes without a K record keep the last value, they don't show it
+				else if (igc_k_due((i>0) ? fixes[i-1].zulu_time : -1, fixes[i].zulu_time)) fixes[i].ext[c-5] = (INT16)v[j++];
+				else fixes[i].ext[c-5] = fixes[i-1].ext[c-5];
+			}
+		}
+	}
+	if (u.failed) printf("%s is not a packed track this logger can read\n", path);
+	else if (fixes==NULL || v==NULL) printf("Not enough memory for %s\n", path);
+	else {
+		IgcWriter w;
+		IgcSink sink;
+		FILE *f;
+		bool stored = true;
+
+		for (INT32 i=0; i<(INT32)count && stored; i++) stored = igc_store_put(&st, &fixes[i]);
+		igc_writer_init(&w, 4096 + (size_t)header_len + (size_t)count*48);
+		igc_record_bytes(&w, header, (size_t)header_len);
+		igc_record_b_all(&w, &st);
+		igc_record_g(&w);
+		if (stored && !w.failed && fopen_s(&f, out, "w")==0) {
+			igc_sink_file(&sink, f);
+			written = igc_writer_flush(&w, &sink);
+			if (fclose(f)!=0) written = false;
+		}
+		igc_writer_free(&w);
+		printf(written ? "Unpacked %d fixes to %s\n" : "Failed to unpack %d fixes to %s\n", (int)count, out);
+	}
+	igc_store_free(&st);
+	free(fixes);
+	free(v);
+	unmap_file(&mf);
+	return written;
+}
+
+//*******************************************************************************
+//**************** BACKGROUND LOG WRITER ****************************************
+//
+// While connected to the sim a save only formats the header records and copies
+// the fixes on the dispatch thread, then a writer thread does the B records and
+// the file, so SimConnect messages keep being pumped and logging carries on.
+// The writer queues each result for the dispatch loop to show the user.
+
+// a log waiting to be written, or written and waiting to be reported
+struct IgcSave {
+	IgcSave *next;
+	IgcWriter w;  // the header records
+	IgcStore track; // a copy of the fixes
+	char fn[MAXBUF];
+	bool written;
+	int journal_log;         // the journal log it is a copy of, -1 if none
+	LONG journal_generation; // of that log when it was queued
+};
+
+struct IgcSaveQueue {
+	IgcSave *head; // waiting to be written
+	IgcSave *tail;
+	IgcSave *done_head; // written
+	IgcSave *done_tail;
+	CRITICAL_SECTION lock;
+	HANDLE ready;  // semaphore, one count per save queued
+	HANDLE thread; // NULL if saves are written in place
+	void (*queued)(IgcSave *save); // set by the journal, so it keeps a log until it is written
+	void (*done)(IgcSave *save);
+};
+
+IgcSaveQueue igc_saves = {};
+
+// format the B and G records after the header and write the file
+void igc_save_write(IgcSave *save) {
+	FILE *f;
+	IgcSink sink;
+
+	size_t header_len = save->w.len;
+
+	igc_record_b_all(&save->w, &save->track);
+	igc_record_g(&save->w);
+	save->written = false;
+	if (fopen_s(&f, save->fn, "w")==0) {
+		igc_sink_file(&sink, f);
+		save->written = igc_writer_flush(&save->w, &sink);
+		if (fclose(f)!=0) save->written = false;
+	}
+	if (save->written && igc_pack) igc_pack_write(save->fn, save->w.buf, header_len, &save->track);
+	igc_writer_free(&save->w);
+	igc_store_free(&save->track);
+}
+
+DWORD WINAPI igc_save_thread(LPVOID param) {
+	while (true) {
+		WaitForSingleObject(igc_saves.ready, INFINITE);
+		EnterCriticalSection(&igc_saves.lock);
+		IgcSave *save = igc_saves.head;
+		if (save!=NULL) {
+			igc_saves.head = save->next;
+			if (igc_saves.head==NULL) igc_saves.tail = NULL;
+		}
+		LeaveCriticalSection(&igc_saves.lock);
+		if (save==NULL) break; // woken by igc_save_stop() with nothing left
+
+		igc_save_write(save);
+		if (debug) printf("\n%s IGC file: %s\n", save->written ? "Wrote" : "Failed to write", save->fn);
+
+		save->next = NULL;
+		EnterCriticalSection(&igc_saves.lock);
+		if (igc_saves.done_tail==NULL) igc_saves.done_head = save;
+		else igc_saves.done_tail->next = save;
+		igc_saves.done_tail = save;
+		LeaveCriticalSection(&igc_saves.lock);
+	}
+	return 0;
+}
+
+void igc_save_start() {
+	InitializeCriticalSection(&igc_saves.lock);
+	igc_saves.ready = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	igc_saves.thread = (igc_saves.ready==NULL) ? NULL : CreateThread(NULL, 0, igc_save_thread, NULL, 0, NULL);
+	if (igc_saves.thread==NULL) {
+		// no writer thread, saves are written in place
+		if (igc_saves.ready!=NULL) CloseHandle(igc_saves.ready);
+		DeleteCriticalSection(&igc_saves.lock);
+	}
+}
+
+// snapshot the log and queue it for the writer thread, false if it can't be
+bool igc_save_queue(char *fn, struct tm *today) {
+	IgcSave *save = (IgcSave *)malloc(sizeof(IgcSave));
 
-    // check for existence of ThermalDescriptions.xml and set therm_code=0 if so
-    if(_access_s("ThermalDescriptions.xml", 0) != 0) {
-        therm_code = 1;
-    } else {
-        therm_code = 0;
-    }
-    
-	char *flight_fn1 = strrchr(flt_pathname, '\\');
-	if (flight_fn1==NULL) flight_fn1 = flt_pathname;
-	else flight_fn1++;
-	char *dot = strrchr(flight_fn1,'.');
-	char flight_filename[1000];
-	if (dot!=NULL) {
-		//strncpy(flight_fn2, flight_fn1, dot-flight_fn1+1);
-		errno_t err = strncpy_s( flight_filename, _countof(flight_filename), flight_fn1, dot-flight_fn1);
-	} else {
-		errno_t err = strcpy_s( flight_filename, flight_fn1);
+	if (save==NULL) return false;
+	igc_writer_init(&save->w, 4096 + igc_record_count*48);
+	if (save->w.failed || !igc_store_copy(&save->track, &igc_track)) {
+		igc_writer_free(&save->w);
+		free(save);
+		return false;
 	}
+	igc_format_header(&save->w, today);
+	strcpy_s(save->fn, fn);
+	save->next = NULL;
+	save->journal_log = -1;
+	if (igc_saves.queued!=NULL) igc_saves.queued(save);
+
+	EnterCriticalSection(&igc_saves.lock);
+	if (igc_saves.tail==NULL) igc_saves.head = save;
+	else igc_saves.tail->next = save;
+	igc_saves.tail = save;
+	LeaveCriticalSection(&igc_saves.lock);
+	ReleaseSemaphore(igc_saves.ready, 1, NULL);
+	return true;
+}
 
-	// make the log filename in fn - file will go in logger.exe folder
-	__time64_t ltime;
-	struct tm today;
-    _time64(&ltime);
-    _localtime64_s( &today, &ltime );
-	//strcpy_s(fn, MAXBUF, "\"");
-	//strcat_s(fn, igc_log_directory);
-	strcpy_s(fn, MAXBUF, igc_log_directory);
-	strcat_s(fn, ATC_ID);
-	strcat_s(fn, "_");
-	strcat_s(fn, flight_filename);
-	strftime(buf, MAXBUF, "_%Y-%m-%d_%H%M", &today );
-	strcat_s(fn, buf);
-	if (strlen(reason)>1) {
-		strcat_s(fn, MAXBUF, "(");
-		strcat_s(fn, MAXBUF, reason);
-		strcat_s(fn, MAXBUF, ")");
+// called from the dispatch loop, tell the user about the logs written since last time
+void igc_save_done() {
+	if (igc_saves.thread==NULL) return;
+	EnterCriticalSection(&igc_saves.lock);
+	IgcSave *save = igc_saves.done_head;
+	igc_saves.done_head = igc_saves.done_tail = NULL;
+	LeaveCriticalSection(&igc_saves.lock);
+	while (save!=NULL) {
+		IgcSave *next = save->next;
+		igc_show_text(save->written, save->fn);
+		if (igc_saves.done!=NULL) igc_saves.done(save);
+		free(save);
+		save = next;
 	}
-	strcat_s(fn, MAXBUF, ".igc");
-	//strcat_s(fn, "\"");
+}
+
+// let the writer finish the saves already queued, then stop it
+void igc_save_stop() {
+	if (igc_saves.thread==NULL) return;
+	ReleaseSemaphore(igc_saves.ready, 1, NULL);
+	WaitForSingleObject(igc_saves.thread, INFINITE);
+	igc_save_done();
+	CloseHandle(igc_saves.thread);
+	CloseHandle(igc_saves.ready);
+	DeleteCriticalSection(&igc_saves.lock);
+	igc_saves.thread = NULL;
+}
+
+// returns false if the log couldn't be written
+bool igc_write_file(char *reason) {
+	FILE *f;
+	char fn[MAXBUF];
+	struct tm today;
+	errno_t err;
+
+	// a streamed log is already on disk
+	if (igc_stream.f!=NULL) return igc_stream_write(reason);
+
+	igc_log_setup(fn, reason, &today);
 
 	// debug
 	if (debug) printf("\nWriting IGC file: %s\n",fn);
+	if (debug) igc_store_print("Track", &igc_track);
+
+	// while connected the writer thread writes it, and the dispatch loop reports it
+	if (igc_saves.thread!=NULL) {
+		if (igc_save_queue(fn, &today)) return true;
+		igc_write_text(false, fn);
+		return false;
+	}
 
 	if( (err = fopen_s(&f, fn, "w")) != 0 ) {
-		char error_text[200];
-		
-		sprintf_s(error_text, 
-				sizeof(error_text), 
-				"igc_logger v%.2f could not write log to file \"%s\"", 
-				version, 
-				fn);
-
-		HRESULT hr = SimConnect_Text(hSimConnect, 
-									SIMCONNECT_TEXT_TYPE_SCROLL_RED, 
-									15.0, 
-									EVENT_MENU_TEXT,
-									sizeof(error_text), 
-									error_text);
-		return;
+		igc_write_text(false, fn);
+		return false;
 	} else {
-		chksum_reset(&chk_data);
-		// ok we've opened the log file - lets write all the data to it
-		sprintf_s(s,MAXBUF,         "AXXX sim_logger v%.2f\n", version); // manufacturer
-		chksum_string(&chk_data, s); fprintf(f, s);
-
-		sprintf_s(s,MAXBUF,		   "HFDTE%02.2d%02.2d%02.2d\n", startup_data.zulu_day,     // date
-														startup_data.zulu_month,
-														startup_data.zulu_year % 1000);
-		chksum_string(&chk_data, s); fprintf(f, s);
+		IgcWriter w;
+		IgcSink sink;
 
-		sprintf_s(s,MAXBUF,         "HFFXA035\n");                        // gps accuracy
-		chksum_string(&chk_data, s); fprintf(f, s);
+		// ok we've opened the log file - format the whole log then write it in one go
+		igc_writer_init(&w, 4096 + igc_record_count*48);
+		size_t header_len = igc_format_log(&w, &today);
+		igc_sink_file(&sink, f);
+		bool written = igc_writer_flush(&w, &sink);
 
-		sprintf_s(s,MAXBUF,         "HFPLTPILOTINCHARGE: not recorded\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+		if (fclose(f)!=0) written = false;
+		if (written && igc_pack) igc_pack_write(fn, w.buf, header_len, &igc_track);
+		igc_writer_free(&w);
 
-		sprintf_s(s,MAXBUF,         "HFCM2CREW2: not recorded\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
-
-		sprintf_s(s,MAXBUF,         "HFGTYGLIDERTYPE:%s\n", TITLE);
-		chksum_string(&chk_data, s); fprintf(f, s);
-
-		sprintf_s(s,MAXBUF,         "HFGIDGLIDERID:%s\n", ATC_ID);
-		chksum_string(&chk_data, s); fprintf(f, s);
+		igc_write_text(written, fn);
+		return written;
+	}
+}
 
-		sprintf_s(s,MAXBUF,         "HFDTM100GPSDATUM: WGS-1984\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+//*******************************************************************************
+//**************** TRACK JOURNAL ************************************************
+//
+// The chunks of igc_track are kept in a memory-mapped journal file rather than
+// in process memory, after a header with everything else igc_write_file() needs.
+// Logging a fix is still just stores into a chunk and the OS writes the pages
+// back, so if the logger dies or the machine loses power the next start finds
+// the fixes there and rebuilds the log from them. Chunk k of the log is chunk k
+// of the file, mapped a segment at a time as the log gets to it, so the file
+// grows with the longest log. The header count goes back to 0 whenever the log
+// is saved or dropped, so only unsaved logs come back. A log the writer thread
+// hasn't got on disk yet stays in the journal until it has, and the next log
+// goes in the header's other slot, in the chunks after it.
+
+char *igc_journal_path = "sim_logger.trk"; // 'journal=' on command line, empty for none
+
+const char IGC_JOURNAL_MAGIC[] = "sim_logger journal 5";
+const int IGC_JOURNAL_LOGS = 2; // the log being recorded and one being saved
+
+// a log in the journal
+struct IgcJournalLog {
+	volatile LONG count; // B records since the log was last saved or reset
+	LONG chunk_base;     // the chunk of the file its chunk 0 is in
+	LONG chunk_count;    // of igc_track, set before count
+	DWORD cx_code;
+	DWORD wx_code;
+	StartupStruct startup_data;
+	char ATC_ID[MAXBUF];
+	char ATC_TYPE[MAXBUF];
+	char TITLE[MAXBUF];
+	char flt_pathname[MAXBUF];
+	char air_pathname[MAXBUF];
+	char pln_pathname[MAXBUF];
+	char wx_pathname[MAXBUF];
+	char cmx_pathname[MAXBUF];
+	char cfg_pathname[MAXBUF];
+	char xml_pathname[MAXBUF];
+	char chksum_flt[CHKSUM_CHARS+1];
+	char chksum_air[CHKSUM_CHARS+1];
+	char chksum_wx[CHKSUM_CHARS+1];
+	char chksum_cmx[CHKSUM_CHARS+1];
+	char chksum_cfg[CHKSUM_CHARS+1];
+	char chksum_xml[CHKSUM_CHARS+1];
+	int c_wp_count;
+	char c_landing[MAXBUF];
+	char c[MAXC][MAXBUF];
+};
 
-		sprintf_s(s,MAXBUF,         "HFRFWFIRMWAREVERSION: %.2f\n", version);
-		chksum_string(&chk_data, s); fprintf(f, s);
+struct IgcJournalHeader {
+	char magic[32];
+	volatile LONG current; // the log being recorded
+	IgcJournalLog log[IGC_JOURNAL_LOGS];
+};
 
-		sprintf_s(s,MAXBUF,         "HFRHWHARDWAREVERSION: 2009\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+// views of the file start on a multiple of the allocation granularity
+const DWORD IGC_JOURNAL_GRANULE = 65536;
+const DWORD IGC_JOURNAL_HEADER_SIZE = (sizeof(IgcJournalHeader)+IGC_JOURNAL_GRANULE-1) / 
+									  IGC_JOURNAL_GRANULE * IGC_JOURNAL_GRANULE;
+const INT32 IGC_SEGMENT_CHUNKS = 256; // chunks mapped at a time
+const DWORD IGC_SEGMENT_SIZE = (IGC_SEGMENT_CHUNKS*sizeof(IgcChunk)+IGC_JOURNAL_GRANULE-1) / 
+							   IGC_JOURNAL_GRANULE * IGC_JOURNAL_GRANULE;
+
+struct IgcJournalSegment {
+	HANDLE mapping;
+	IgcChunk *chunks; // IGC_SEGMENT_CHUNKS of them
+};
 
-		sprintf_s(s,MAXBUF,         "HFFTYFRTYPE: sim_logger by Ian Forster-Lewis\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+HANDLE igc_journal_file = INVALID_HANDLE_VALUE;
+HANDLE igc_journal_mapping = NULL;
+IgcJournalHeader *igc_journal = NULL;
+IgcJournalSegment *igc_journal_segments = NULL; // mapped so far
+INT32 igc_journal_segment_count = 0;
+LONGLONG igc_journal_file_chunks = 0; // in the file when it was opened
+
+// saves of each log queued and not yet written, and the times each log has
+// been started over, so a save finishing late can't clear a newer log
+CRITICAL_SECTION igc_journal_lock;
+LONG igc_journal_pending[IGC_JOURNAL_LOGS];
+LONG igc_journal_generation[IGC_JOURNAL_LOGS];
+
+// the log being recorded
+inline IgcJournalLog *igc_journal_log() {
+	return &igc_journal->log[igc_journal->current];
+}
 
-		sprintf_s(s,MAXBUF,         "HFGPSGPS:Microsoft Flight Simulator\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+// copy the flight's details into the header, at its first fix
+void igc_journal_start() {
+	IgcJournalLog *h = igc_journal_log();
+
+	h->startup_data = startup_data;
+	strcpy_s(h->ATC_ID, ATC_ID);
+	strcpy_s(h->ATC_TYPE, ATC_TYPE);
+	strcpy_s(h->TITLE, TITLE);
+	strcpy_s(h->flt_pathname, flt_pathname);
+	strcpy_s(h->air_pathname, air_pathname);
+	strcpy_s(h->pln_pathname, pln_pathname);
+	strcpy_s(h->wx_pathname, wx_pathname);
+	strcpy_s(h->cmx_pathname, cmx_pathname);
+	strcpy_s(h->cfg_pathname, cfg_pathname);
+	strcpy_s(h->xml_pathname, xml_pathname);
+	strcpy_s(h->chksum_flt, chksum_flt);
+	strcpy_s(h->chksum_air, chksum_air);
+	strcpy_s(h->chksum_wx, chksum_wx);
+	strcpy_s(h->chksum_cmx, chksum_cmx);
+	strcpy_s(h->chksum_cfg, chksum_cfg);
+	strcpy_s(h->chksum_xml, chksum_xml);
+	h->c_wp_count = (c_wp_count<MAXC-2) ? c_wp_count : MAXC-2;
+	memcpy(h->c_landing, c_landing, MAXBUF);
+	memcpy(h->c, c, sizeof(h->c));
+}
 
-		sprintf_s(s,MAXBUF,         "HFPRSPRESSALTSENSOR: Microsoft Flight Simulator\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+// the last fix of igc_track is in, count it in the header
+void igc_journal_point() {
+	IgcJournalLog *h = igc_journal_log();
 
-		sprintf_s(s,MAXBUF,         "HFCIDCOMPETITIONID:%s\n", ATC_ID);
-		chksum_string(&chk_data, s); fprintf(f, s);
+	h->cx_code = cx_code;
+	h->wx_code = wx_code;
+	h->chunk_count = igc_track.chunk_count;
+	// a full barrier, so the count never gets ahead of the fix
+	InterlockedExchange(&h->count, igc_record_count);
+}
 
-		sprintf_s(s,MAXBUF,         "HFCCLCOMPETITIONCLASS:Microsoft Flight Simulator\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+// put the flight's details of log h back, for igc_write_file()
+void igc_journal_restore(const IgcJournalLog *h) {
+	startup_data = h->startup_data;
+	cx_code = h->cx_code;
+	wx_code = h->wx_code;
+	// a torn or corrupt journal may leave a field unterminated, which strcpy_s() would abort on
+	strncpy_s(ATC_ID, h->ATC_ID, _TRUNCATE);
+	strncpy_s(ATC_TYPE, h->ATC_TYPE, _TRUNCATE);
+	strncpy_s(TITLE, h->TITLE, _TRUNCATE);
+	strncpy_s(flt_pathname, h->flt_pathname, _TRUNCATE);
+	strncpy_s(air_pathname, h->air_pathname, _TRUNCATE);
+	strncpy_s(pln_pathname, h->pln_pathname, _TRUNCATE);
+	strncpy_s(wx_pathname, h->wx_pathname, _TRUNCATE);
+	strncpy_s(cmx_pathname, h->cmx_pathname, _TRUNCATE);
+	strncpy_s(cfg_pathname, h->cfg_pathname, _TRUNCATE);
+	strncpy_s(xml_pathname, h->xml_pathname, _TRUNCATE);
+	strncpy_s(chksum_flt, h->chksum_flt, _TRUNCATE);
+	strncpy_s(chksum_air, h->chksum_air, _TRUNCATE);
+	strncpy_s(chksum_wx, h->chksum_wx, _TRUNCATE);
+	strncpy_s(chksum_cmx, h->chksum_cmx, _TRUNCATE);
+	strncpy_s(chksum_cfg, h->chksum_cfg, _TRUNCATE);
+	strncpy_s(chksum_xml, h->chksum_xml, _TRUNCATE);
+	c_wp_count = (h->c_wp_count>=0 && h->c_wp_count<MAXC-2) ? h->c_wp_count : 0;
+	memcpy(c_landing, h->c_landing, MAXBUF);
+	memcpy(c, h->c, sizeof(c));
+	c_landing[MAXBUF-1] = '\0';
+	for (int i=0; i<MAXC; i++) c[i][MAXBUF-1] = '\0';
+}
 
-							// extension record to say info at end of 'B' recs
-							// FXA = fix accuracy
-							// SIU = satellites in use
-							// ENL = engine noise level 000-999
-		sprintf_s(s,MAXBUF,         "I023638FXA3941ENL\n"); 
-		chksum_string(&chk_data, s); fprintf(f, s);
+// chunk k of the journal, mapping its segment when the log first gets to it,
+// NULL if the file can't grow
+IgcChunk *igc_journal_chunk(INT32 k) {
+	INT32 n = k / IGC_SEGMENT_CHUNKS;
+
+	while (igc_journal_segment_count<=n) {
+		IgcJournalSegment *segments = (IgcJournalSegment *)realloc(igc_journal_segments, 
+									  (igc_journal_segment_count+1)*sizeof(IgcJournalSegment));
+		if (segments==NULL) return NULL;
+		igc_journal_segments = segments;
+		IgcJournalSegment *seg = &segments[igc_journal_segment_count];
+		ULONGLONG offset = IGC_JOURNAL_HEADER_SIZE + (ULONGLONG)igc_journal_segment_count*IGC_SEGMENT_SIZE;
+		ULONGLONG end = offset + IGC_SEGMENT_SIZE;
+		// a mapping past the end of the file grows it, filled with zeros
+		seg->mapping = CreateFileMappingA(igc_journal_file, NULL, PAGE_READWRITE, (DWORD)(end>>32), (DWORD)end, NULL);
+		if (seg->mapping==NULL) return NULL;
+		seg->chunks = (IgcChunk *)MapViewOfFile(seg->mapping, FILE_MAP_WRITE, (DWORD)(offset>>32), (DWORD)offset, 
+												IGC_SEGMENT_SIZE);
+		if (seg->chunks==NULL) {
+			CloseHandle(seg->mapping);
+			return NULL;
+		}
+		igc_journal_segment_count++;
+	}
+	return &igc_journal_segments[n].chunks[k % IGC_SEGMENT_CHUNKS];
+}
 
-		// Task (C) records
-		if (c_wp_count>1) {
-			chksum_string(&chk_data, c[0]); fprintf(f, c[0]);
-			chksum_string(&chk_data, c[1]); fprintf(f, c[1]);
-			for (int i=0; i<c_wp_count; i++) {
-				chksum_string(&chk_data, c[i+2]); fprintf(f, c[i+2]);
+// the journal can't grow (disk full, no address space), so carry on with st
+// in pool chunks. The log stays in the journal as far as it got, and the next
+// log tries the journal again. False if the pool is out of memory too.
+bool igc_journal_detach(IgcStore *st) {
+	IgcJournalLog *h = igc_journal_log();
+
+	for (INT32 k=0; k<st->chunk_count; k++) {
+		IgcChunk *chunk = igc_pool_get();
+		if (chunk==NULL) {
+			// back to the journal chunks copied so far, which are all mapped
+			while (--k>=0) {
+				igc_pool_put(st->chunks[k]);
+				st->chunks[k] = igc_journal_chunk(h->chunk_base + k);
 			}
-			chksum_string(&chk_data, c_landing); fprintf(f, c_landing);
+			return false;
 		}
+		memcpy(chunk, st->chunks[k], sizeof(IgcChunk));
+		st->chunks[k] = chunk;
+	}
+	st->new_chunk = NULL;
+	if (debug) printf("\nJournal can't grow, the rest of this log is only in memory (%d B records in the journal)\n", 
+					  h->count);
+	return true;
+}
 
-		// FSX Comment (L) records
-		strftime( buf, 50, "L FSX date/time on users PC:  %Y-%m-%d %H:%M\n", &today );            // date
-		sprintf_s(s,MAXBUF,buf);
-		chksum_string(&chk_data, s); fprintf(f, s);
+// new_chunk of igc_track while it is in the journal
+IgcChunk *igc_journal_new_chunk(IgcStore *st) {
+	IgcChunk *chunk = igc_journal_chunk(igc_journal_log()->chunk_base + st->chunk_count);
+	if (chunk==NULL && igc_journal_detach(st)) chunk = igc_pool_get();
+	return chunk;
+}
 
-		//sprintf_s(s,MAXBUF,		   "L FSX FLT filename %s\n", flt_pathname);
-		//chksum_string(&chk_data, s); fprintf(f, s);
-		sprintf_s(s,MAXBUF,		   "L FSX FLT checksum            %s (%s)\n", chksum_flt, flt_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+// igc_saves.queued, a save of the log being recorded is queued
+void igc_journal_save_queued(IgcSave *save) {
+	EnterCriticalSection(&igc_journal_lock);
+	save->journal_log = igc_journal->current;
+	save->journal_generation = igc_journal_generation[save->journal_log];
+	igc_journal_pending[save->journal_log]++;
+	LeaveCriticalSection(&igc_journal_lock);
+}
 
-		//sprintf_s(s,MAXBUF,		   "L FSX PLN filename %s\n", pln_pathname);
-		//chksum_string(&chk_data, s); fprintf(f, s);
-		//sprintf_s(s,MAXBUF,		   "L FSX PLN checksum %s\n", chksum_pln);
-		//chksum_string(&chk_data, s); fprintf(f, s);
+// igc_saves.done, once the last save of a log that has been started over
+// is written the log can go from the journal
+void igc_journal_save_done(IgcSave *save) {
+	int n = save->journal_log;
+
+	if (n<0) return;
+	EnterCriticalSection(&igc_journal_lock);
+	if (igc_journal_generation[n]==save->journal_generation && --igc_journal_pending[n]==0 && 
+		save->written && n!=igc_journal->current) {
+		if (debug) printf("\nJournal: log %d saved\n", n);
+		InterlockedExchange(&igc_journal->log[n].count, 0);
+	}
+	LeaveCriticalSection(&igc_journal_lock);
+}
 
-		//sprintf_s(s,MAXBUF,		   "L FSX WX filename %s\n", wx_pathname);
-		//chksum_string(&chk_data, s); fprintf(f, s);
-		sprintf_s(s,MAXBUF,		   "L FSX WX checksum             %s (%s)\n", chksum_wx, wx_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+// start the next log. One with a save still to be written is kept, and the
+// next goes in the other slot after its chunks, dropping what was there
+void igc_journal_reset() {
+	EnterCriticalSection(&igc_journal_lock);
+	int n = igc_journal->current;
+	int m = (n+1) % IGC_JOURNAL_LOGS;
+	IgcJournalLog *h = &igc_journal->log[n];
+	IgcJournalLog *next = &igc_journal->log[m];
+	if (igc_journal_pending[n]>0 && h->count>0) {
+		if (debug && next->count>0) printf("\nJournal: no room to keep log %d until it is saved\n", m);
+		InterlockedExchange(&next->count, 0);
+		igc_journal_generation[m]++;
+		igc_journal_pending[m] = 0;
+		next->chunk_base = h->chunk_base + h->chunk_count;
+		next->chunk_count = 0;
+		InterlockedExchange(&igc_journal->current, m);
+	} else {
+		InterlockedExchange(&h->count, 0);
+		// back to the start of the file once no other log is kept
+		if (next->count==0) h->chunk_base = 0;
+	}
+	LeaveCriticalSection(&igc_journal_lock);
+}
 
-		//sprintf_s(s,MAXBUF,		   "L FSX CMX filename %s\n", cmx_pathname);
-		//chksum_string(&chk_data, s); fprintf(f, s);
-		sprintf_s(s,MAXBUF,		   "L FSX CMX checksum            %s (%s)\n", chksum_cmx, cmx_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+// map the journal and keep the B records in it from now on, false if it can't be
+bool igc_journal_open(char *path) {
+	LARGE_INTEGER size;
 
-		sprintf_s(s,MAXBUF,		   "L FSX mission checksum        %s (%s)\n", chksum_xml, xml_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+	igc_journal_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+								   OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (igc_journal_file==INVALID_HANDLE_VALUE) {
+		if (debug) printf("Can't open journal %s\n", path);
+		return false;
+	}
+	if (!GetFileSizeEx(igc_journal_file, &size)) size.QuadPart = 0;
+	// the mapping grows a new or short file to the header size, filled with zeros
+	igc_journal_mapping = CreateFileMappingA(igc_journal_file, NULL, PAGE_READWRITE, 0, IGC_JOURNAL_HEADER_SIZE, NULL);
+	if (igc_journal_mapping!=NULL)
+		igc_journal = (IgcJournalHeader *)MapViewOfFile(igc_journal_mapping, FILE_MAP_WRITE, 0, 0, IGC_JOURNAL_HEADER_SIZE);
+	if (igc_journal==NULL) {
+		if (debug) printf("Can't map journal %s\n", path);
+		if (igc_journal_mapping!=NULL) CloseHandle(igc_journal_mapping);
+		CloseHandle(igc_journal_file);
+		igc_journal_mapping = NULL;
+		igc_journal_file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	igc_journal_file_chunks = (size.QuadPart-IGC_JOURNAL_HEADER_SIZE) / IGC_SEGMENT_SIZE * IGC_SEGMENT_CHUNKS;
+	InitializeCriticalSection(&igc_journal_lock);
+	memset(igc_journal_pending, 0, sizeof(igc_journal_pending));
+	igc_saves.queued = igc_journal_save_queued;
+	igc_saves.done = igc_journal_save_done;
+	igc_store_free(&igc_track);
+	igc_track.new_chunk = igc_journal_new_chunk;
+	if (strcmp(igc_journal->magic, IGC_JOURNAL_MAGIC)!=0 || (DWORD)igc_journal->current>=(DWORD)IGC_JOURNAL_LOGS) {
+		memset(igc_journal, 0, sizeof(IgcJournalHeader));
+		strcpy_s(igc_journal->magic, IGC_JOURNAL_MAGIC);
+	}
+	return true;
+}
 
-		sprintf_s(s,MAXBUF,		   "L FSX aircraft.cfg checksum   %s (%s)\n", chksum_cfg, cfg_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+// put log n of the journal back in igc_track, returns its number of B records.
+// Its chunks in file order, every one with a fix and already in the file, the
+// last cut back to the count if its newest fix wasn't counted.
+INT32 igc_journal_load(int n) {
+	const IgcJournalLog *h = &igc_journal->log[n];
+	LONG count = h->count;
+	LONG chunk_count = h->chunk_count;
+	LONG base = h->chunk_base;
+
+	igc_store_reset(&igc_track);
+	if (count<=0 || chunk_count<=0 || chunk_count>count || base<0 || 
+		base+(LONGLONG)chunk_count>igc_journal_file_chunks) return 0;
+	while (igc_track.count<count && igc_track.chunk_count<chunk_count) {
+		IgcChunk *chunk = igc_journal_chunk(base + igc_track.chunk_count);
+		if (chunk==NULL || chunk->count<=0 || chunk->count>IGC_CHUNK_FIXES || !igc_store_grow(&igc_track)) break;
+		if (chunk->count>count-igc_track.count) chunk->count = count-igc_track.count;
+		igc_track.chunks[igc_track.chunk_count++] = chunk;
+		igc_track.count += chunk->count;
+	}
+	return igc_track.count;
+}
 
-		//sprintf_s(s,MAXBUF,		   "L FSX AIR filename %s\n", air_pathname);
-		//chksum_string(&chk_data, s); fprintf(f, s);
-		sprintf_s(s,MAXBUF,		   "L FSX AIR checksum            %s (%s)\n", chksum_air, air_name);
-		chksum_string(&chk_data, s); fprintf(f, s);
+void igc_journal_close() {
+	if (igc_journal==NULL) return;
+	igc_saves.queued = NULL;
+	igc_saves.done = NULL;
+	DeleteCriticalSection(&igc_journal_lock);
+	igc_store_free(&igc_track); // back to an empty store in memory
+	for (INT32 n=0; n<igc_journal_segment_count; n++) {
+		UnmapViewOfFile(igc_journal_segments[n].chunks);
+		CloseHandle(igc_journal_segments[n].mapping);
+	}
+	free(igc_journal_segments);
+	UnmapViewOfFile(igc_journal);
+	CloseHandle(igc_journal_mapping);
+	CloseHandle(igc_journal_file);
+	igc_journal = NULL;
+	igc_journal_mapping = NULL;
+	igc_journal_file = INVALID_HANDLE_VALUE;
+	igc_journal_segments = NULL;
+	igc_journal_segment_count = 0;
+}
 
-		// write CumulusX status locked/unlocked
-		if (cx_code==0)
-			sprintf_s(s,MAXBUF,		   "L FSX CumulusX status:        UNLOCKED\n");
-		else
-			sprintf_s(s,MAXBUF,		   "L FSX CumulusX status:        LOCKED OK\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+// open the journal and write out any logs an earlier run didn't get to save,
+// returns false if there were some and one couldn't be written
+bool igc_journal_recover(char *path) {
+	bool written = true;
+
+	if (!igc_journal_open(path)) return true;
+	// one that was waiting to be saved, then the one being recorded
+	for (int k=1; k<=IGC_JOURNAL_LOGS; k++) {
+		int n = (igc_journal->current+k) % IGC_JOURNAL_LOGS;
+		INT32 count = igc_journal_load(n);
+		if (count>IGC_MIN_RECORDS) {
+			if (debug) printf("Recovering %d B records from journal %s\n", count, path);
+			igc_journal_restore(&igc_journal->log[n]);
+			igc_log_names();
+			igc_record_count = count;
+			if (!igc_write_file((char *)(k<IGC_JOURNAL_LOGS ? "recovered save" : "recovered"))) written = false;
+		}
+		InterlockedExchange(&igc_journal->log[n].count, 0);
+		igc_store_reset(&igc_track);
+		igc_record_count = 0;
+	}
+	igc_journal->current = 0;
+	igc_journal->log[0].chunk_base = 0;
+	return written;
+}
 
-		// write wx status (unlocked if user has entered weather menu
-		// after a WX file load
-		if (wx_code==0)
-			sprintf_s(s,MAXBUF,		   "L FSX WX status=              UNLOCKED\n");
-		else
-			sprintf_s(s,MAXBUF,		   "L FSX WX status=              LOCKED OK\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
+void igc_reset_log() {
+	//c_wp_count = 0;
+	// a streamed log stays on disk, unless it is too short
+	if (igc_stream.f!=NULL) igc_stream_close(NULL);
+	if (igc_journal!=NULL) igc_journal_reset();
+	igc_store_reset(&igc_track);
+	// back in the journal if the last log had to leave it
+	if (igc_journal!=NULL) igc_track.new_chunk = igc_journal_new_chunk;
+	igc_record_count = 0;
+}
 
-		// ThermalDescriptions.xml entry
-		if (therm_code==0)
-			sprintf_s(s,MAXBUF,		   "L FSX ThermalDescriptions.xml STILL BEING USED\n");
-		else
-			sprintf_s(s,MAXBUF,		   "L FSX ThermalDescriptions.xml REMOVED OK\n");
-		chksum_string(&chk_data, s); fprintf(f, s);
-
-		// now calculate a value for the GENERAL CHECKSUM
-		chksum_chksum(chksum_all);
-		sprintf_s(s,MAXBUF,		   "L FSX GENERAL CHECKSUM            %s  <---- CHECK THIS FIRST\n", chksum_all);
-		chksum_string(&chk_data, s); fprintf(f, s);
-
-		// now do the 'B' location records
-		for (INT32 i=0; i<igc_record_count; i++) {
-			int hours = igc_pos[i].zulu_time / 3600;
-			int minutes = (igc_pos[i].zulu_time - hours * 3600 ) / 60;
-			int secs = igc_pos[i].zulu_time % 60;
-			char NS = (igc_pos[i].latitude>0.0) ? 'N' : 'S';
-			char EW = (igc_pos[i].longitude>0.0) ? 'E' : 'W';
-			double abs_latitude = fabs(igc_pos[i].latitude);
-			double abs_longitude = fabs(igc_pos[i].longitude);
-			int lat_DD = int(abs_latitude);
-			int lat_MM = int( (abs_latitude - float(lat_DD)) * 60.0);
-			int lat_mmm = int( (abs_latitude - float(lat_DD) - (float(lat_MM) / 60.0)) * 60000.0);
-			int long_DDD = int(abs_longitude);
-			int long_MM = int((abs_longitude - float(long_DDD)) * 60.0);
-			int long_mmm = int((abs_longitude - float(long_DDD) - (float(long_MM) / 60.0)) * 60000.0);
-			int altitude = int(igc_pos[i].altitude);
-            int FXA = 27;
-            int ENL = (int(igc_pos[i].rpm)>9990)? 999 : int(igc_pos[i].rpm) / 10;
-
-//			sprintf_s(s,MAXBUF,     "B %02.2d %02.2d %02.2d %02.2d %02.2d %03.3d %c %03.3d %02.2d %03.3d %c A %05.5d %05.5d 000\n",
-			sprintf_s(s,MAXBUF,     "B%02.2d%02.2d%02.2d%02.2d%02.2d%03.3d%c%03.3d%02.2d%03.3d%cA%05.5d%05.5d%03.3d%03.3d\n",
-				    hours, minutes, secs,
-					lat_DD, lat_MM, lat_mmm, NS,
-					long_DDD, long_MM, long_mmm, EW,
-					altitude, altitude, FXA, ENL);
-			chksum_string(&chk_data, s); fprintf(f, s);
+void igc_log_point(const IgcSample *s) {
+	// a streamed log only keeps the last fix in igc_track, to format it
+	bool stream = igc_stream.f!=NULL || (igc_streaming && igc_record_count==0 && igc_stream_open());
+	INT32 prev_time = (igc_record_count>0) ? igc_track.last_time : -1;
+
+	if (igc_record_count>0 && s->pos.zulu_time==igc_track.last_time) return;
+	if (stream) {
+		igc_store_reset(&igc_track);
+		if (igc_store_add(&igc_track, s)) {
+			igc_track.chunks[0]->prev_time = prev_time; // for its K record
+			igc_stream_point();
+			igc_record_count++;
 		}
-		chksum_to_string(chksum, chk_data);
-		fprintf(f,         "G%s\n",chksum);
+	} else if (igc_store_add(&igc_track, s)) {
+		igc_record_count = igc_track.count;
+		// not once igc_journal_detach() has taken the log out of the journal
+		if (igc_journal!=NULL && igc_track.new_chunk!=NULL) {
+			if (igc_record_count==1) igc_journal_start();
+			igc_journal_point();
+		}
+	}
+}
 
-		fclose(f);
+//*******************************************************************************
+//**************** ADAPTIVE SAMPLER *********************************************
+//
+// With the "adaptive" flag each position from the sim is offered to igc_sample()
+// rather than logging every IGC_TICK_COUNT'th, and a fix is kept only when the
+// log needs one. Drawing straight lines between the fixes, in time as well as
+// space, has to put the aircraft within igc_tolerance metres east and north
+// (igc_tolerance_alt up) of every position in between, and fixes are at most
+// igc_max_interval seconds apart. So a thermal gets a fix most seconds and a
+// straight glide one every igc_max_interval. Each position since the last fix
+// narrows the range of velocities from that fix which still pass it, so the
+// decision is a few compares: the first position outside the range makes the
+// one before it the next fix. The positions still come once a second, as a B
+// record only has whole seconds.
+
+bool igc_adaptive = false;       // "adaptive" flag
+double igc_tolerance = 10.0;     // 'tolerance=' on command line, metres east and north
+double igc_tolerance_alt = 3.0;  // metres up
+INT32 igc_max_interval = 10;     // 'interval=' on command line, seconds
+
+const double IGC_METRES_PER_DEGREE = 111194.9; // of latitude, for the mean radius of the earth
+const double IGC_RADIANS_PER_DEGREE = 3.14159265358979 / 180.0;
+
+struct IgcSampler {
+	bool anchored;       // anchor is the last fix logged
+	bool pending;        // last is a position since the anchor, not logged
+	IgcSample anchor;
+	IgcSample last;
+	double lo[3];        // slowest velocities east, north and up (m/s) from the anchor
+	double hi[3];        // fastest, that pass every position since it
+};
 
-		char file_write_text[132];
-		
-		sprintf_s(file_write_text, 
-				sizeof(file_write_text), 
-				"igc_logger v%.2f wrote %s", 
-				version, 
-				fn);
+IgcSampler igc_sampler = {};
+
+// log s, and measure from it from now on
+void igc_sample_anchor(const IgcSample *s) {
+	if (debug) printf("B(%d,%d) ",int(s->pos.altitude), s->pos.rpm);
+	igc_log_point(s);
+	igc_sampler.anchored = true;
+	igc_sampler.pending = false;
+	memcpy(&igc_sampler.anchor, s, igc_sample_size);
+	for (int k=0; k<3; k++) {
+		igc_sampler.lo[k] = -HUGE_VAL;
+		igc_sampler.hi[k] = HUGE_VAL;
+	}
+}
+
+// metres east, north and up from the anchor to p
+void igc_sample_offset(const UserStruct *p, double d[3]) {
+	const UserStruct *a = &igc_sampler.anchor.pos;
+	double dlon = p->longitude - a->longitude;
 
-		HRESULT hr = SimConnect_Text(hSimConnect, 
-									SIMCONNECT_TEXT_TYPE_PRINT_GREEN, 
-									6.0, 
-									EVENT_MENU_TEXT, //sizeof("TESTING"), "TESTING"); 
-									sizeof(file_write_text), 
-									file_write_text);
+	if (dlon>180.0) dlon -= 360.0;
+	else if (dlon<-180.0) dlon += 360.0;
+	d[0] = dlon * IGC_METRES_PER_DEGREE * cos(a->latitude * IGC_RADIANS_PER_DEGREE);
+	d[1] = (p->latitude - a->latitude) * IGC_METRES_PER_DEGREE;
+	d[2] = p->altitude - a->altitude;
+}
+
+// true if p can be the next fix, passing every position since the anchor
+bool igc_sample_fits(const UserStruct *p) {
+	INT32 dt = p->zulu_time - igc_sampler.anchor.pos.zulu_time;
+	double d[3];
+
+	if (dt>igc_max_interval) return false;
+	igc_sample_offset(p, d);
+	for (int k=0; k<3; k++) {
+		double v = d[k] / dt;
+		if (v<igc_sampler.lo[k] || v>igc_sampler.hi[k]) return false;
+	}
+	return true;
+}
+
+// log the position waiting to be a fix, so a saved log ends where the aircraft is
+void igc_sample_flush() {
+	if (igc_adaptive && igc_sampler.anchored && igc_sampler.pending && igc_record_count>0)
+		igc_sample_anchor(&igc_sampler.last);
+}
+
+void igc_sample(const IgcSample *sample) {
+	IgcSampler *s = &igc_sampler;
+	const UserStruct *p = &sample->pos;
+	double d[3];
+
+	if (igc_record_count==0) s->anchored = false; // the log was saved or dropped
+	// the sim clock going back starts again from p
+	if (s->anchored && p->zulu_time<s->anchor.pos.zulu_time) igc_sample_flush();
+	if (!s->anchored || p->zulu_time<s->anchor.pos.zulu_time) {
+		igc_sample_anchor(sample);
+		return;
+	}
+	// paused
+	if (p->zulu_time==s->anchor.pos.zulu_time || (s->pending && p->zulu_time<=s->last.pos.zulu_time)) return;
+
+	if (!igc_sample_fits(p)) {
+		if (!s->pending) {
+			igc_sample_anchor(sample);
+			return;
+		}
+		igc_sample_anchor(&s->last);
+	}
+	// the fixes after this one have to pass it too
+	INT32 dt = p->zulu_time - s->anchor.pos.zulu_time;
+	igc_sample_offset(p, d);
+	for (int k=0; k<3; k++) {
+		double tolerance = (k<2) ? igc_tolerance : igc_tolerance_alt;
+		double lo = (d[k] - tolerance) / dt;
+		double hi = (d[k] + tolerance) / dt;
+		if (lo>s->lo[k]) s->lo[k] = lo;
+		if (hi<s->hi[k]) s->hi[k] = hi;
 	}
+	memcpy(&s->last, sample, igc_sample_size);
+	s->pending = true;
 }
 
-// this routine used to trigger an igc_file_write, but not used now
+// with the "split" flag a landing saves the log of that flight and starts a new one
 void igc_ground_check(INT32 on_ground, INT32 zulu_time) {
 	// test for start of flight
 	if (igc_record_count<2) {
@@ -1056,6 +4638,13 @@ void igc_ground_check(INT32 on_ground, INT32 zulu_time) {
 			   // AND was airborn long enough
   		if (debug) printf("\nLanding detected\n"); 
 		igc_prev_on_ground = 1;
+		if (igc_split && igc_record_count>IGC_MIN_RECORDS) {
+			char reason[20];
+			sprintf_s(reason, sizeof(reason), "flight %d", ++igc_flight_count);
+			igc_sample_flush();
+			igc_write_file(reason);
+			igc_reset_log();
+		}
 	} else {
 		igc_prev_on_ground = on_ground;
 	}
@@ -1064,6 +4653,149 @@ void igc_ground_check(INT32 on_ground, INT32 zulu_time) {
 //*********************************************************************************************
 //********** this is the main message handling loop of logger, receiving messages from FS **
 //*********************************************************************************************
+// a position from the sim: log it when the sampler needs it, or on every nth tick,
+// and check for a takeoff or landing
+void igc_process_pos(const IgcSample *s) {
+	user_pos = s->pos;
+	// store position to igc log array when the sampler needs it, or on every nth tick
+	if (igc_adaptive) {
+		igc_sample(s);
+	} else if (++igc_tick_counter==IGC_TICK_COUNT) {
+		if (debug) printf("B(%d,%d) ",int(user_pos.altitude), user_pos.rpm);
+		igc_log_point(s);
+		igc_tick_counter = 0;
+	}
+	if (debug_events && user_pos.sim_on_ground!=0) printf(" [REQUEST_USER_POS (%d)G] ", igc_record_count);
+	if (debug_events && user_pos.sim_on_ground==0) printf(" [REQUEST_USER_POS (%d)A] ", igc_record_count);
+	// process 'on ground' status and decide whether to write a log file
+	igc_ground_check(user_pos.sim_on_ground, user_pos.zulu_time);
+}
+
+//*******************************************************************************
+//**************** POSITION RING ************************************************
+//
+// While connected the dispatch proc only copies each position into a ring, and
+// the ring thread does the rest with igc_process_pos(), so nothing slow holds up
+// the next CallDispatch. The ring has one writer and one reader, each moving its
+// own index and only reading the other, so a push or pop takes no lock. Any other
+// message may use the log too, so it is handled holding igc_ring.lock, which the
+// ring thread holds while it logs positions, after logging any still in the ring.
+// A push to a full ring is dropped, or with 'overflow=decimate' every other one
+// is skipped from half full, so the ring keeps up with any rate of positions.
+
+const LONG IGC_RING_SIZE = 256; // positions, a power of 2
+
+static enum IGC_RING_OVERFLOW {
+	IGC_RING_DROP,
+	IGC_RING_DECIMATE,
+};
+
+struct IgcRing {
+	IgcSample pos[IGC_RING_SIZE];
+	volatile LONG head; // positions pushed, only moved by the dispatch thread
+	volatile LONG tail; // positions popped, only moved by the ring thread
+	IGC_RING_OVERFLOW overflow; // 'overflow=' on command line
+	LONG dropped;       // pushed to a full ring
+	LONG decimated;     // skipped from half full
+	LONG peak;          // most positions waiting
+	bool skip;          // decimating, skip the next one
+	volatile LONG stop;
+	HANDLE ready;       // set by each push
+	HANDLE thread;
+	CRITICAL_SECTION lock;
+};
+
+IgcRing igc_ring = {};
+
+// called from the dispatch proc
+void igc_ring_push(const IgcSample *p) {
+	LONG head = igc_ring.head;
+	LONG waiting = head - igc_ring.tail;
+
+	if (waiting>=IGC_RING_SIZE) {
+		igc_ring.dropped++;
+		return;
+	}
+	if (igc_ring.overflow==IGC_RING_DECIMATE && waiting>=IGC_RING_SIZE/2) {
+		igc_ring.skip = !igc_ring.skip;
+		if (igc_ring.skip) {
+			igc_ring.decimated++;
+			return;
+		}
+	}
+	memcpy(&igc_ring.pos[head & (IGC_RING_SIZE-1)], p, igc_sample_size);
+	// a full barrier, so the ring thread never sees the head before the position
+	InterlockedExchange(&igc_ring.head, head+1);
+	if (waiting+1>igc_ring.peak) igc_ring.peak = waiting+1;
+	SetEvent(igc_ring.ready);
+}
+
+// log the positions waiting in the ring, holding igc_ring.lock
+void igc_ring_drain() {
+	while (igc_ring.tail!=igc_ring.head) {
+		// logged from its slot, which is the dispatch thread's again once the tail has passed it
+		igc_process_pos(&igc_ring.pos[igc_ring.tail & (IGC_RING_SIZE-1)]);
+		InterlockedExchange(&igc_ring.tail, igc_ring.tail+1);
+	}
+}
+
+DWORD WINAPI igc_ring_thread(LPVOID param) {
+	while (true) {
+		WaitForSingleObject(igc_ring.ready, INFINITE);
+		// igc_ring_stop() comes after the last push, so that's in the ring too
+		bool stop = igc_ring.stop!=0;
+		EnterCriticalSection(&igc_ring.lock);
+		igc_ring_drain();
+		LeaveCriticalSection(&igc_ring.lock);
+		if (stop) break;
+	}
+	return 0;
+}
+
+void igc_ring_start() {
+	DWORD id;
+
+	InitializeCriticalSection(&igc_ring.lock);
+	igc_ring.head = igc_ring.tail = 0;
+	igc_ring.stop = 0;
+	igc_ring.ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+	igc_ring.thread = (igc_ring.ready==NULL) ? NULL : CreateThread(NULL, 0, igc_ring_thread, NULL, 0, &id);
+	if (igc_ring.thread==NULL) {
+		// no ring thread, positions are logged in the dispatch proc
+		if (igc_ring.ready!=NULL) CloseHandle(igc_ring.ready);
+		DeleteCriticalSection(&igc_ring.lock);
+	}
+	// nothing is pushed before this returns, so the ring thread has logged nothing yet
+	else igc_text_start(id);
+}
+
+// keep the ring thread off the log until igc_ring_release(), logging here any
+// positions pushed so far that it hasn't got to. Only the dispatch thread
+// pushes, so nothing is added to the ring meanwhile
+void igc_ring_hold() {
+	EnterCriticalSection(&igc_ring.lock);
+	igc_ring_drain();
+}
+
+void igc_ring_release() {
+	LeaveCriticalSection(&igc_ring.lock);
+}
+
+// let the ring thread log the positions still in the ring, then stop it
+void igc_ring_stop() {
+	if (igc_ring.thread==NULL) return;
+	InterlockedExchange(&igc_ring.stop, 1);
+	SetEvent(igc_ring.ready);
+	WaitForSingleObject(igc_ring.thread, INFINITE);
+	if (debug) printf("\nPosition ring: %d pushed, %d waiting at most, %d dropped, %d decimated\n", 
+					  igc_ring.head, igc_ring.peak, igc_ring.dropped, igc_ring.decimated);
+	CloseHandle(igc_ring.thread);
+	CloseHandle(igc_ring.ready);
+	DeleteCriticalSection(&igc_ring.lock);
+	igc_ring.thread = NULL;
+	igc_text_stop(); // the reports of the last positions
+}
+
 void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pContext)
 {   
     //HRESULT hr;
@@ -1090,6 +4822,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
 					
 				case EVENT_MENU_WRITE_LOG:
 					if (debug) printf(" [EVENT_MENU_WRITE_LOG]\n");
+					igc_sample_flush();
 					igc_write_file("");
                     break;
 					
@@ -1158,6 +4891,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
                 {
 					// startup data will be requested at SIM START
 					if (debug) printf(" [REQUEST_STARTUP_DATA] ");
+					igc_subscription_reply(REQUEST_STARTUP_DATA, cbData);
                     StartupStruct *pU = (StartupStruct*)&pObjData->dwData;
 					startup_data.start_time = pU->start_time;
 					startup_data.zulu_day = pU->zulu_day;
@@ -1175,6 +4909,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
                 {
 					// startup data will be requested at SIM START
 					if (debug) printf(" [REQUEST_AIRCRAFT_DATA] ");
+					igc_subscription_reply(REQUEST_AIRCRAFT_DATA, cbData);
 					AircraftStruct *pS = (AircraftStruct*)&pObjData->dwData;
                     char *pszATC_ID;
                     char *pszATC_TYPE;
@@ -1201,25 +4936,10 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
 
                 case REQUEST_USER_POS:
 				{
-					// these events will come back once per second
-					// from get_user_pos_updates() call
-                    UserStruct *pU = (UserStruct*)&pObjData->dwData;
-					user_pos.latitude = pU->latitude;
-					user_pos.longitude = pU->longitude;
-					user_pos.altitude = pU->altitude;
-					user_pos.sim_on_ground = pU->sim_on_ground;
-					user_pos.zulu_time = pU->zulu_time;
-					user_pos.rpm = pU->rpm;
-					// store position to igc log array on every nth tick
-					if (++igc_tick_counter==IGC_TICK_COUNT) {
-						if (debug) printf("B(%d,%d) ",int(user_pos.altitude), user_pos.rpm);
-						igc_log_point(user_pos);
-						igc_tick_counter = 0;
-					}
-					if (debug_events && user_pos.sim_on_ground!=0) printf(" [REQUEST_USER_POS (%d)G] ", igc_record_count);
-					if (debug_events && user_pos.sim_on_ground==0) printf(" [REQUEST_USER_POS (%d)A] ", igc_record_count);
-					// process 'on ground' status and decide whether to write a log file
-					igc_ground_check(user_pos.sim_on_ground, user_pos.zulu_time);
+					// these events will come back once per second, or when
+					// something changes, from get_user_pos_updates() call
+					const IgcSample *s = igc_pos_sample(pObjData, cbData);
+					if (s!=NULL) igc_process_pos(s);
                     break;
                 }
 
@@ -1289,6 +5009,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
 						wx_code = 1;
 					chksum_binary_file(chksum_cmx, cmx_pathname);
 					chksum_binary_file(chksum_xml, xml_pathname);
+					igc_log_names();
 					get_startup_data();
                     break;
 
@@ -1308,6 +5029,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
 					// calculate checksum for AIR and aircraft.cfg file
 					chksum_binary_file(chksum_air, air_pathname);
 					chksum_cfg_file(chksum_cfg, cfg_pathname);
+					igc_log_names();
 					get_startup_data();
                     break;
 
@@ -1319,6 +5041,7 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
 					// copy filename into flight_pathname global
 					strcpy_s(pln_pathname, evt->szFileName);
 					pln_to_c(pln_pathname);
+					igc_log_names();
 					//get_startup_data();
                     break;
 
@@ -1332,10 +5055,9 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
         case SIMCONNECT_RECV_ID_QUIT:
         {
 			// write the IGC file if there is one
-			if (igc_record_count>IGC_MIN_RECORDS) {
-				igc_write_file("autosave on quit");
-				igc_reset_log();
-			}
+			igc_sample_flush();
+			if (igc_record_count>IGC_MIN_RECORDS) igc_write_file("autosave on quit");
+			igc_reset_log(); // also removes a streamed log too short to keep
 			// set flag to trigger a quit
             quit = 1;
             break;
@@ -1347,6 +5069,106 @@ void CALLBACK MyDispatchProcSO(SIMCONNECT_RECV* pData, DWORD cbData, void *pCont
     }
 }
 
+// the dispatch proc while the ring thread is running: a position is only pushed,
+// anything else waits for the positions before it to be logged
+void CALLBACK igc_ring_dispatch(SIMCONNECT_RECV* pData, DWORD cbData, void *pContext)
+{
+	if (pData->dwID==SIMCONNECT_RECV_ID_SIMOBJECT_DATA) {
+		SIMCONNECT_RECV_SIMOBJECT_DATA *pObjData = (SIMCONNECT_RECV_SIMOBJECT_DATA*) pData;
+		if (pObjData->dwRequestID==REQUEST_USER_POS) {
+			const IgcSample *s = igc_pos_sample(pObjData, cbData);
+			if (s!=NULL) igc_ring_push(s);
+			return;
+		}
+	}
+	igc_ring_hold();
+	MyDispatchProcSO(pData, cbData, pContext);
+	igc_ring_release();
+}
+
+//*******************************************************************************
+//**************** DISPATCH LOOP ************************************************
+//
+// SimConnect sets igc_dispatch.event when it has messages waiting, so the loop
+// sleeps until there is something to dispatch rather than waking every
+// millisecond to look. The wait gives up after IGC_HOUSEKEEPING_MS so logs the
+// writer thread has finished are still reported with no message to wake it.
+// One signal can stand for several messages, so each wakeup dispatches all of
+// them, not just the next one.
+// 'dispatch=poll' keeps the old CallDispatch and Sleep(1) loop. In debug mode
+// the wakeups and the process CPU time are shown when the loop ends, to compare
+// the two.
+
+const DWORD IGC_HOUSEKEEPING_MS = 250;
+
+struct IgcDispatch {
+	bool poll;          // 'dispatch=poll' on command line
+	HANDLE event;       // given to SimConnect_Open, NULL when polling
+	LONG wakeups;
+	LONG timeouts;      // wakeups with no message
+	LONG drained;       // messages after the first of a wakeup
+	LARGE_INTEGER start;
+	ULONGLONG cpu;      // process time at the start
+};
+
+IgcDispatch igc_dispatch = {};
+
+// user and kernel time of the process so far, in 100ns units
+ULONGLONG igc_process_cpu() {
+	FILETIME created, exited, kernel, user;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+	return (((ULONGLONG)kernel.dwHighDateTime<<32) | kernel.dwLowDateTime) +
+		   (((ULONGLONG)user.dwHighDateTime<<32) | user.dwLowDateTime);
+}
+
+// returns the event for SimConnect_Open, NULL to poll
+HANDLE igc_dispatch_start() {
+	igc_dispatch.event = igc_dispatch.poll ? NULL : CreateEvent(NULL, FALSE, FALSE, NULL);
+	igc_dispatch.wakeups = 0;
+	igc_dispatch.timeouts = 0;
+	igc_dispatch.drained = 0;
+	QueryPerformanceCounter(&igc_dispatch.start);
+	igc_dispatch.cpu = igc_process_cpu();
+	return igc_dispatch.event;
+}
+
+// dispatch every message SimConnect has waiting. CallDispatch() only takes
+// the next, so the rest come from GetNextDispatch() until it has none left.
+HRESULT igc_dispatch_all(DispatchProc proc) {
+	SIMCONNECT_RECV *pData;
+	DWORD cbData;
+
+	HRESULT hr = SimConnect_CallDispatch(hSimConnect, proc, NULL);
+	while (hr==S_OK && SUCCEEDED(SimConnect_GetNextDispatch(hSimConnect, &pData, &cbData))) {
+		proc(pData, cbData, NULL);
+		igc_dispatch.drained++;
+	}
+	return hr;
+}
+
+// wait for SimConnect's next messages, or for the next housekeeping
+void igc_dispatch_wait() {
+	if (igc_dispatch.event==NULL) Sleep(1);
+	else if (WaitForSingleObject(igc_dispatch.event, IGC_HOUSEKEEPING_MS)==WAIT_TIMEOUT) igc_dispatch.timeouts++;
+	igc_dispatch.wakeups++;
+}
+
+void igc_dispatch_stop() {
+	if (debug && igc_dispatch.wakeups>0) {
+		LARGE_INTEGER freq, now;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&now);
+		double secs = (double)(now.QuadPart-igc_dispatch.start.QuadPart) / freq.QuadPart;
+		double cpu_ms = (igc_process_cpu()-igc_dispatch.cpu) / 1e4;
+		printf("\nDispatch loop (%s): %d wakeups in %.1f s, %.1f/s, %d timeouts, %d messages drained, CPU %.0f ms (%.2f%%)\n",
+			   (igc_dispatch.event==NULL) ? "poll" : "event", igc_dispatch.wakeups, secs, igc_dispatch.wakeups/secs,
+			   igc_dispatch.timeouts, igc_dispatch.drained, cpu_ms, cpu_ms/10.0/secs);
+	}
+	if (igc_dispatch.event!=NULL) CloseHandle(igc_dispatch.event);
+	igc_dispatch.event = NULL;
+}
+
 void connectToSim()
 {
     HRESULT hr;
@@ -1358,7 +5180,8 @@ void connectToSim()
 				"igc_logger v%.2f", 
 				version);
 
-    if (SUCCEEDED(SimConnect_Open(&hSimConnect, sim_connect_string, NULL, 0, 0, 0)))
+	igc_subscriptions_reset();
+    if (SUCCEEDED(SimConnect_Open(&hSimConnect, sim_connect_string, NULL, 0, igc_dispatch_start(), 0)))
     {
         if (debug_info || debug) printf("SimConnect_Open succeeded\n", version);   
           
@@ -1434,39 +5257,15 @@ void connectToSim()
                                             "number",
 											SIMCONNECT_DATATYPE_INT32);
 
-		// DEFINITION_USER_POS
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "Plane Latitude", 
-                                            "degrees");
-
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "Plane Longitude", 
-                                            "degrees");
-
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "PLANE ALTITUDE", 
-                                            "meters");
-
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "SIM ON GROUND", 
-                                            "bool",
-											SIMCONNECT_DATATYPE_INT32);
-
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "ZULU TIME", 
-                                            "seconds",
-											SIMCONNECT_DATATYPE_INT32);
-
-        hr = SimConnect_AddToDataDefinition(hSimConnect, 
-                                            DEFINITION_USER_POS,
-                                            "GENERAL ENG RPM:1", 
-                                            "Rpm",
-											SIMCONNECT_DATATYPE_INT32);
+		// DEFINITION_USER_POS, a sample of igc_channels
+		for (int k=0; k<IGC_CHANNELS; k++) {
+			hr = SimConnect_AddToDataDefinition(hSimConnect, 
+												DEFINITION_USER_POS,
+												igc_channels[k].name, 
+												igc_channels[k].units,
+												igc_channels[k].type,
+												0, k); // datum id k in tagged updates
+		}
 
 		// Listen for the CumulusX.ReportSessionCode event
 		hr = SimConnect_MapClientEventToSimEvent(hSimConnect, EVENT_CX_CODE, "CumulusX.ReportSessionCode");
@@ -1493,22 +5292,33 @@ void connectToSim()
 
 		// Now loop checking for messages until quit
 		hr  = S_OK;
+		igc_save_start();
+		igc_ring_start();
         while( hr == S_OK && 0 == quit )
         {
-            hr = SimConnect_CallDispatch(hSimConnect, MyDispatchProcSO, NULL);
-            Sleep(1);
+            hr = igc_dispatch_all((igc_ring.thread!=NULL) ? igc_ring_dispatch : MyDispatchProcSO);
+			igc_save_done();
+			igc_text_done();
+			igc_dispatch_wait();
         } 
-		if (hr==S_OK) hr = SimConnect_Close(hSimConnect);
-		else {
+		igc_dispatch_stop();
+		if (debug) igc_subscriptions_print();
+		igc_ring_stop(); // log the positions still in the ring
+		if (hr==S_OK) {
+			igc_save_stop(); // finish the saves still being written
+			hr = SimConnect_Close(hSimConnect);
+		} else {
 			if (debug) printf("Fail code from CallDispatch\n");
 			// write the IGC file if there is one
-			if (igc_record_count>IGC_MIN_RECORDS) {
-				igc_write_file("autosave on fsx crash");
-			}
+			igc_sample_flush();
+			if (igc_record_count>IGC_MIN_RECORDS) igc_write_file("autosave on fsx crash");
+			igc_reset_log(); // also removes a streamed log too short to keep
+			igc_save_stop();
 		}
 
 	} else {
 	    if (debug) printf("Couldn't connect to FSX.. logger will exit now\n");
+		igc_dispatch_stop();
 	}
 }
 
@@ -1517,7 +5327,16 @@ void connectToSim()
 int main(int argc, char* argv[])
 {
 	bool no_flags = true;
+	int poll_ms = CHKSUM_TAIL_POLL;
+	bool batch = argc>=2 && (strcmp(argv[1],"batch")==0 || strcmp(argv[1],"validate")==0 || 
+							 strcmp(argv[1],"index")==0);
+	unsigned int env_fields = (1<<IGC_ENV_GENERAL)-1; // all but the general checksum
+	BatchList batch_list = {};
+	chksum_init_tables();
+	igc_pool_init();
+	igc_channels_init();
 	igc_reset_log();
+	igc_log_names();
 
 	// set up command line arguments (debug mode)
 	for (int i=1; i<argc; i++) {
@@ -1528,10 +5347,79 @@ int main(int argc, char* argv[])
 		else if (strcmp(argv[i],"info")==0)      debug_info = true; // will open console window
 		else if (strcmp(argv[i],"calls")==0)     debug_calls = true;
 		else if (strcmp(argv[i],"events")==0)    debug_events = true;
+		else if (strcmp(argv[i],"nosimd")==0)  {
+			chksum_simd = CHKSUM_SIMD_SCALAR;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"stream")==0)  {
+			igc_streaming = true;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"split")==0)   {
+			igc_split = true;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"pack")==0)   {
+			igc_pack = true;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"adaptive")==0)   {
+			igc_adaptive = true;
+			no_flags = false;
+		}
+		else if (strncmp(argv[i],"tolerance=",10)==0) {
+			igc_tolerance = atof(argv[i]+10);
+			// 0 or less would turn off the bound on how far a fix can be left out
+			if (!(igc_tolerance>0)) {
+				printf("Tolerance must be more than 0 in \"%s\"\n", argv[i]);
+				return 1;
+			}
+			no_flags = false;
+		}
+		else if (strncmp(argv[i],"interval=",9)==0) {
+			igc_max_interval = atoi(argv[i]+9);
+			if (igc_max_interval<=0) {
+				printf("Interval must be more than 0 in \"%s\"\n", argv[i]);
+				return 1;
+			}
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"overflow=decimate")==0) {
+			igc_ring.overflow = IGC_RING_DECIMATE;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"overflow=drop")==0) {
+			igc_ring.overflow = IGC_RING_DROP;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"dispatch=poll")==0) {
+			igc_dispatch.poll = true;
+			no_flags = false;
+		}
+		else if (strcmp(argv[i],"updates=all")==0) {
+			igc_pos_flags = SIMCONNECT_DATA_REQUEST_FLAG_DEFAULT;
+			no_flags = false;
+		}
+		else if (strncmp(argv[i],"threads=",8)==0) worker_threads = atoi(argv[i]+8);
+		else if (strncmp(argv[i],"poll=",5)==0)  poll_ms = atoi(argv[i]+5);
+		else if (strncmp(argv[i],"socket=",7)==0) daemon_socket = argv[i]+7;
+		else if (strncmp(argv[i],"index=",6)==0) igc_index_path = argv[i]+6;
+		else if (strncmp(argv[i],"fields=",7)==0) {
+			env_fields = igc_env_fields(argv[i]+7);
+			if (env_fields==0) {
+				printf("Unknown field in \"%s\"\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strncmp(argv[i],"journal=",8)==0) {
+			igc_journal_path = argv[i]+8;
+			no_flags = false;
+		}
 		else if (strncmp(argv[i],"log=",4)==0)   {
 			igc_log_directory = argv[i]+4;
 			no_flags = false;
 		}
+		else if (batch && i>1) batch_add(&batch_list, argv[i]);
 	}
 
     //debug
@@ -1539,34 +5427,56 @@ int main(int argc, char* argv[])
     //return 0;
     //debug end
 
-	if (argc==2 && !debug && no_flags) {
-		printf("\nChecking igc file checksum\n");
-		Sleep(1000);printf(".");
-		Sleep(1000);printf(".");
-		Sleep(1000);printf(".\n");
-		
-		switch (check_file(argv[1]))
-		{
-			case CHKSUM_OK:
-				printf("IGC file checks OK.\n");
-				break;
+	// "tail <igc file>" verifies a log that is still arriving
+	if (argc>=3 && strcmp(argv[1],"tail")==0) {
+		print_chksum_result(tail_file(argv[2], poll_ms), argv[2]);
+		return 0;
+	}
 
-			case CHKSUM_TOO_SHORT:
-				printf("BAD CHECKSUM. This file contains a checksum but it is too short.\n");
-				break;
+	// "serve" checks files for other programs over a local socket
+	if (argc>=2 && strcmp(argv[1],"serve")==0) {
+		return serve(daemon_socket);
+	}
 
-			case CHKSUM_NOT_FOUND:
-				printf("BAD CHECKSUM. This file does not contain a 'G' record.\n");
-				break;
+	// "batch <folders/wildcards/files>" checks whole archives, exit code 1 if any fail
+	// "validate <folders/wildcards/files>" checks their structure too
+	// "index <folders/wildcards/files>" saves their environments to the index file
+	if (batch) {
+		batch_list.validate = strcmp(argv[1],"validate")==0;
+		batch_list.index = strcmp(argv[1],"index")==0;
+		int failed = batch_check(&batch_list);
+		if (batch_list.index) igc_index_save(&batch_list, igc_index_path);
+		batch_free(&batch_list);
+		return failed>0 ? 1 : 0;
+	}
 
-			case CHKSUM_BAD:
-				printf("BAD CHECKSUM. 'G' record found but checksum is wrong.\n");
-				break;
+	// "bench [count]" compares the B record encoder with sprintf_s()
+	if (argc>=2 && strcmp(argv[1],"bench")==0) {
+		int count = (argc>=3) ? atoi(argv[2]) : 0;
+		return igc_b_bench(count>0 ? count : 1000000);
+	}
 
-			case CHKSUM_FILE_ERROR:
-				printf("FILE ERROR. Couldn't read the igc file \"%s\".\n", argv[1]);
-				break;
-		}
+	// "recover" writes the log left in the journal by a run that didn't save it
+	if (argc>=2 && strcmp(argv[1],"recover")==0) {
+		bool written = igc_journal_recover(igc_journal_path);
+		igc_journal_close();
+		return written ? 0 : 1;
+	}
+
+	// "unpack <file.igcb> [<file.igc>]" rebuilds a log from its packed track
+	if (argc>=3 && strcmp(argv[1],"unpack")==0) {
+		return igc_unpack_file(argv[2], (argc>=4) ? argv[3] : NULL) ? 0 : 1;
+	}
+
+	// "query <reference igc file>" lists logs in the index flown in a different environment
+	if (argc>=3 && strcmp(argv[1],"query")==0) {
+		return igc_index_query(argv[2], igc_index_path, env_fields);
+	}
+
+	if (argc==2 && !debug && no_flags) {
+		printf("\nChecking igc file checksum\n");
+		
+		print_chksum_result(check_file(argv[1]), argv[1]);
 
 		return 0;
 	}
@@ -1579,6 +5489,12 @@ int main(int argc, char* argv[])
 		if (debug_info) printf("+info");
 		if (debug_calls) printf("+calls");
 		if (debug_events) printf("+events");
+		if (igc_streaming) printf("+stream");
+		if (igc_split) printf("+split");
+		if (igc_pack) printf("+pack");
+		if (igc_pos_flags==SIMCONNECT_DATA_REQUEST_FLAG_DEFAULT) printf("+updates=all");
+		if (igc_adaptive) printf("+adaptive (%.0fm, %ds)", igc_tolerance, igc_max_interval);
+		printf(" checksum %s", chksum_simd_names[chksum_simd]);
 		//printf("\n");
 		//chksum_string("jhsdfhsfkjhwefkjwfnm sdfmberfwnbefx");
 		//chksum_to_string();
@@ -1588,6 +5504,10 @@ int main(int argc, char* argv[])
 		printf("Debug mode = debug_info\n");
 	}
 
+	// the journal may hold the log of a run that died before saving it
+	if (igc_journal_path[0]!='\0') igc_journal_recover(igc_journal_path);
+
     connectToSim();
+	igc_journal_close();
     return 0;
 }
\ No newline at end of file